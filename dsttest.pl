@@ -0,0 +1,132 @@
+#!/usr/bin/perl
+#
+# Check the daylight saving changes the firmware works out against
+# tzdata, for every year it handles (2000-2099).  daynum(), weekday(),
+# dst_rules[] and dst_time() are lifted out of iv.c and built for the
+# host; zdump gives the changes for a zone following each rule.
+#
+# usage: dsttest.pl [-v]
+#	-v	list every change, not just the ones that disagree
+#
+# The US rule has only been the current one since 2007, so earlier US
+# years aren't compared.  The host's int is wider than the AVR's, so
+# this can't show up 16-bit overflow.
+
+use strict;
+use Getopt::Std;
+use File::Temp qw(tempdir);
+
+my %opt;
+getopts('v', \%opt) or die "usage: $0 [-v]\n";
+
+my $CC = $ENV{CC} || 'cc';
+my %ZONE = (US => 'America/New_York', EU => 'Europe/Berlin');
+my %FIRST = (US => 2007, EU => 2000);
+
+# --- the firmware's side ---
+
+open(my $f, '<', 'iv.c') or die "$0: iv.c: $!\n";
+my $src = do { local $/; <$f> };
+close $f;
+
+# a definition from its first line to the brace that closes it
+sub lift {
+    my $start = shift;
+    my $at = index($src, $start);
+    die "$0: no '$start' in iv.c\n" if $at < 0;
+
+    my $depth = 0;
+    for (my $i = index($src, '{', $at); $i < length $src; $i++) {
+	my $c = substr($src, $i, 1);
+	$depth++ if $c eq '{';
+	next unless $c eq '}' && !--$depth;
+	my $end = $i + 1;
+	$end++ if substr($src, $end, 1) eq ';';
+	return substr($src, $at, $end - $at) . "\n\n";
+    }
+    die "$0: '$start' never ends\n";
+}
+
+my $prog = <<'EOF';
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#define PROGMEM
+#define pgm_read_byte(p)	(*(const uint8_t *)(p))
+#define pgm_read_word(p)	(*(const uint16_t *)(p))
+#define DST_US 1
+#define DST_EU 2
+
+EOF
+$prog .= lift($_) for ('static uint16_t daynum(', 'static uint8_t weekday(',
+		       'struct dst_rule {', 'static const struct dst_rule dst_rules',
+		       'static uint32_t dst_time(');
+$prog .= <<'EOF';
+/* each change, as local time before it: rule year-month-day hour */
+int main(void)
+{
+  static const char *name[] = { "US", "EU" };
+  uint8_t mode, y, i;
+
+  for (mode = DST_US; mode <= DST_EU; mode++)
+    for (y = 0; y < 100; y++)
+      for (i = 0; i < 2; i++) {
+	time_t t = 946684800 + dst_time(y, &dst_rules[mode - 1][i]);
+	struct tm *tm = gmtime(&t);
+
+	printf("%s %04d-%02d-%02d %02d\n", name[mode - 1],
+	       tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday, tm->tm_hour);
+      }
+  return 0;
+}
+EOF
+
+my $dir = tempdir(CLEANUP => 1);
+open(my $c, '>', "$dir/dst.c") or die "$0: $dir/dst.c: $!\n";
+print $c $prog;
+close $c;
+system($CC, '-std=gnu99', '-funsigned-char', '-Wall', '-o', "$dir/dst",
+       "$dir/dst.c") == 0 or die "$0: can't build the host copy\n";
+
+my %fw;				# rule -> year -> [changes]
+for (`$dir/dst`) {
+    my ($rule, $year, $when) = /^(\w+) ((\d+)-\S+ \d+)$/ ? ($1, $3, $2) : ();
+    push @{$fw{$rule}{$year}}, $when if $rule;
+}
+
+# --- tzdata's side ---
+
+my %MON = (Jan => 1, Feb => 2, Mar => 3, Apr => 4, May => 5, Jun => 6,
+	   Jul => 7, Aug => 8, Sep => 9, Oct => 10, Nov => 11, Dec => 12);
+
+my %tz;
+for my $rule (keys %ZONE) {
+    # the last second before each change, in local time
+    for (`zdump -v -c 2000,2100 $ZONE{$rule}`) {
+	next unless /= \w+ (\w+)\s+(\d+) (\d+):59:59 (\d+) /;
+	push @{$tz{$rule}{$4}},
+	    sprintf('%04d-%02d-%02d %02d', $4, $MON{$1}, $2, $3 + 1);
+    }
+    die "$0: zdump knows nothing of $ZONE{$rule}\n" unless $tz{$rule};
+}
+
+# --- compare ---
+
+my ($checked, $bad) = (0, 0);
+for my $rule (sort keys %ZONE) {
+    for my $year ($FIRST{$rule} .. 2099) {
+	my $want = join(', ', @{$tz{$rule}{$year} || []});
+	my $got = join(', ', @{$fw{$rule}{$year} || []});
+
+	$checked++;
+	if ($want ne $got) {
+	    $bad++;
+	    print "$rule $year: firmware $got, tzdata $want\n";
+	} elsif ($opt{v}) {
+	    print "$rule $year: $got\n";
+	}
+    }
+}
+printf "%d years checked, %d wrong\n", $checked, $bad;
+exit($bad != 0);
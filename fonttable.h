@@ -1,4 +1,85 @@
-const uint8_t alphatable[] PROGMEM = {
+/*
+ * Segments for each character from ' ' to DEL, indexed by c - ' '.
+ * Bit 7 is segment A down to bit 1 for G, and bit 0 is the dot:
+ *
+ *  -A-
+ * F   B
+ *  -G-
+ * E   C
+ *  -D-  .H
+ *
+ * Uppercase letters get the nearest shape seven segments allow, where
+ * it differs from the lowercase one; blanks have no sensible shape.
+ */
+#define FONT_FIRST	' '
+#define FONT_SIZE	96
+
+const uint8_t font[FONT_SIZE] PROGMEM = {
+	0x00, /*   */
+	0x61, /* ! */
+	0x44, /* " */
+	0x00, /* # */
+	0xB6, /* $ */
+	0x4A, /* % */
+	0x00, /* & */
+	0x40, /* ' */
+	0x9C, /* ( */
+	0xF0, /* ) */
+	0xC6, /* * */
+	0x62, /* + */
+	0x01, /* , */
+	0x02, /* - */
+	0x01, /* . */
+	0x4A, /* / */
+	0xFC, /* 0 */
+	0x60, /* 1 */
+	0xDA, /* 2 */
+	0xF2, /* 3 */
+	0x66, /* 4 */
+	0xB6, /* 5 */
+	0xBE, /* 6 */
+	0xE0, /* 7 */
+	0xFE, /* 8 */
+	0xE6, /* 9 */
+	0x00, /* : */
+	0x00, /* ; */
+	0x1A, /* < */
+	0x12, /* = */
+	0x32, /* > */
+	0xCA, /* ? */
+	0xFA, /* @ */
+	0xEE, /* A */
+	0x3E, /* B */
+	0x9C, /* C */
+	0x7A, /* D */
+	0x9E, /* E */
+	0x8E, /* F */
+	0xBC, /* G */
+	0x6E, /* H */
+	0x0C, /* I */
+	0x78, /* J */
+	0xAE, /* K */
+	0x1C, /* L */
+	0xAA, /* M */
+	0xEC, /* N */
+	0xFC, /* O */
+	0xCE, /* P */
+	0xFD, /* Q */
+	0x8C, /* R */
+	0xB6, /* S */
+	0x1E, /* T */
+	0x7C, /* U */
+	0x7C, /* V */
+	0xB8, /* W */
+	0x6E, /* X */
+	0x76, /* Y */
+	0xDA, /* Z */
+	0x9C, /* [ */
+	0x26, /* \ */
+	0xF0, /* ] */
+	0xC4, /* ^ */
+	0x10, /* _ */
+	0x04, /* ` */
 	0xFA, /* a */
 	0x3E, /* b */
 	0x1A, /* c */
@@ -9,34 +90,28 @@ const uint8_t alphatable[] PROGMEM = {
 	0x2E, /* h */
 	0x60, /* i */
 	0x78, /* j */
-	0xAE, //k
-	0x1C, // l
-	0xAA, // m
-	0x2A, // n
-	0x3A, // o
-	0xCE, //p
-	0xF3, // q
-	0x0A, //r
-	0xB6, //s
-	0x1E, //t
-	0x38, //u
-	0x38, //v // fix?
-	0xB8, //w
-	0x6E, //x
-	0x76, // y
-	0xDA, //z
-	/* more */
+	0xAE, /* k */
+	0x1C, /* l */
+	0xAA, /* m */
+	0x2A, /* n */
+	0x3A, /* o */
+	0xCE, /* p */
+	0xF3, /* q */
+	0x0A, /* r */
+	0xB6, /* s */
+	0x1E, /* t */
+	0x38, /* u */
+	0x38, /* v */
+	0xB8, /* w */
+	0x6E, /* x */
+	0x76, /* y */
+	0xDA, /* z */
+	0x9C, /* { */
+	0x0C, /* | */
+	0xF0, /* } */
+	0x80, /* ~ */
+	0x00, /* DEL */
 };
 
-const uint8_t numbertable[] PROGMEM = { 
-  0xFC /* 0 */, 
-  0x60 /* 1 */,
-  0xDA /* 2 */,
-  0xF2 /* 3 */,
-  0x66 /* 4 */,
-  0xB6 /* 5 */,
-  0xBE, /* 6 */
-  0xE0, /* 7 */
-  0xFE, /* 8 */
-  0xE6, /* 9 */
-};
+/* the digits, for numbers */
+#define numbertable	(font + '0' - FONT_FIRST)
@@ -35,6 +35,23 @@ THE SOFTWARE.
 #include "util.h"
 #include "fonttable.h"
 
+#ifdef SIMTRACE
+/*
+ * Under simavr, trace the MAX6921 interface to iv.vcd for
+ * vfdtrace.pl.  avr_mcu_section.h comes with simavr.
+ */
+#include "avr_mcu_section.h"
+AVR_MCU(F_CPU, "atmega168");
+AVR_MCU_VCD_FILE("iv.vcd", 1000);
+const struct avr_mmcu_vcd_trace_t _vfdtrace[] _MMCU_ = {
+  { AVR_MCU_VCD_SYMBOL("SPDR"), .what = (void *)&SPDR, },
+  { AVR_MCU_VCD_SYMBOL("LOAD"), .mask = _BV(VFDLOAD),
+    .what = (void *)&VFDLOAD_PORT, },
+  { AVR_MCU_VCD_SYMBOL("BLANK"), .mask = _BV(VFDBLANK),
+    .what = (void *)&VFDBLANK_PORT, },
+};
+#endif
+
 static uint8_t region = REGION_US;
 static uint8_t secondmode = SEC_FULL;
 
@@ -42,6 +59,14 @@ static uint8_t secondmode = SEC_FULL;
 #define DRIFT_BASELINE	127
 static int8_t drift = 0;
 
+/* A deadline that never comes */
+#define NEVER	0xffffffff
+
+/* Daylight saving: rule in use, and when and how the clock next changes */
+static uint8_t dst_mode = DST_OFF;
+static uint32_t dst_next = NEVER;	/* in clock_secs */
+static int8_t dst_shift;		/* hours */
+
 /*
  * Barrier to force compiler to make sure memory is up-to-date.  This
  * is preferable to using "volatile" because we can just resync with
@@ -50,8 +75,14 @@ static int8_t drift = 0;
  */
 #define barrier()	asm volatile("" : : : "memory")
 
-static unsigned char __display_str(uint8_t *disp, const char *s);
+static unsigned char __display_str_P(uint8_t *disp, const char *s);
+static unsigned char render_str(uint8_t *disp, const char *s, uint8_t progmem,
+				uint8_t max);
+static void display_marquee(uint8_t n, transition_t *trans);
 static uint8_t setalarmstate(void);
+static void dark_wakeup(void);
+static void boost_restart(void);
+static uint8_t glyph(char c);
 
 struct timedate {
   struct time {
@@ -62,21 +93,48 @@ struct timedate {
   } date;
 };
 
-// These variables store the current time and date.
+static void secs_to_timedate(uint32_t t, struct timedate *td);
+
+// The RTC interrupt just counts clock_secs, seconds since 2000-01-01
+// 00:00.  The time and date fields in timedate are derived from it by
+// timedate_sync() when something needs to show or compare them.
+static volatile uint32_t clock_secs;
 struct timedate timedate;
-static volatile uint8_t suspend_update; /* if set, don't update */
+static uint32_t timedate_at;		/* clock_secs that timedate is for */
+static volatile uint8_t suspend_update; /* if set, timedate is being edited */
+
+// Compare value for the RTC's next second, for drift correction
+static volatile uint8_t rtc_ocr = DRIFT_BASELINE;
+
+// Everything that happens at a set time is a deadline in clock_secs
+static uint32_t clock_last;		/* clock_secs at last clock_update() */
+static uint32_t hour_next;		/* start of the next hour */
+static uint8_t drift_pending;		/* drift correction loaded for it */
+static uint32_t alarm_next;		/* when the alarm next goes off */
 
 // how loud is the speaker supposed to be?
 uint8_t volume;
 
-// whether the alarm is on, going off, and alarm time
+// whether the alarm is on, going off, and the alarm times; alarm and
+// alarm_days hold whichever one is being shown or set
 static uint8_t alarm_on, alarming;
+static volatile uint8_t alarm_switched;	/* switch went off; main loop acts */
+static struct time alarms[NALARMS];
+static uint8_t alarms_days[NALARMS];
 static struct time alarm;
 static uint8_t alarm_days = DAYS_ALL;
+static uint8_t alarm_num = 1;		/* which alarm is in alarm, from 1 */
+static uint8_t alarm_due;		/* which goes off at alarm_next */
 
 /* hour morning and evening start */
 static uint8_t morning, evening;
 static uint8_t daybrite, nightbrite;
+static uint8_t autobrite;		/* follow ambient light instead */
+
+/* hours the display is off, if they differ */
+static uint8_t dark_start, dark_end;
+static uint8_t dark_window;		/* now within them */
+static uint32_t dark_until;		/* unless woken until then */
 
 // are we in low power sleep mode?
 volatile uint8_t sleepmode = 0;
@@ -85,11 +143,29 @@ static uint8_t timeunknown = 0;        // MEME
 static uint8_t restored = 0;
 
 // Our display buffer, which is updated to show the time/date/etc
-// and is multiplexed onto the tube
 static uint8_t display[DISPLAYSIZE]; // stores segments, not values!
-static uint8_t output_display[DISPLAYSIZE]; // stores segments, not values!
+
+// What's on the tube: the mux interrupt refreshes from frames[front]
+// and never looks at the other one, so transitions build the next
+// frame in output_display (the back frame) with interrupts enabled,
+// and publish it by flipping front.
+static uint8_t frames[2][DISPLAYSIZE]; // stores segments, not values!
+static volatile uint8_t front;
+static uint8_t *output_display = frames[1];
 static uint8_t currdigit = 0;        // which digit we are currently multiplexing
 
+// Text too long for the tube is rendered once into marquee[], and the
+// mux interrupt scrolls a window along it in place of digits 1-8.
+#define MARQUEE_MAX	24	/* characters */
+#define MARQUEE_RATE	150	/* ms per character */
+#define MARQUEE_HOLD	600	/* extra ms at the start of each pass */
+#define MARQUEE_GAP	3	/* blanks before it comes round again */
+static uint8_t marquee[MARQUEE_MAX];	// stores segments, not values!
+static volatile uint8_t marquee_len;	/* 0 when not scrolling */
+static volatile uint8_t marquee_pos;	/* first character on the tube */
+static volatile uint8_t marquee_laps;	/* passes completed */
+static int16_t marquee_tick;
+
 // This table allow us to index between what digit we want to light up
 // and what the pin number is on the MAX6921 see the .h for values.
 // Stored in ROM (PROGMEM) to save RAM
@@ -111,10 +187,6 @@ static const uint8_t segmenttable[] PROGMEM = {
 static uint16_t muxdiv = 0;
 #define MUX_DIVIDER (300 / DISPLAYSIZE)
 
-// Likewise divides 100Hz down to 1Hz for the alarm beeping
-uint16_t alarmdiv = 0;
-#define ALARM_DIVIDER 100
-
 // How long we have been snoozing
 static uint8_t snooze = MAXSNOOZE / 60;
 static uint16_t snoozetimer = 0;
@@ -157,9 +229,153 @@ void delayms(uint16_t ms) {
     sleep();
 }
 
+/*
+ * Before anything else runs, paint the RAM between the end of static
+ * data and the top of the stack with a canary value.  The stack never
+ * shrinks back over the paint, so counting the canaries left shows
+ * how close it has come to the static data.  Written in assembler
+ * because there's no stack (or zero register) yet in .init1.
+ */
+#define STACK_CANARY	0xc5
+
+extern uint8_t _end;
+extern uint8_t __stack;
+
+void stack_paint(void) __attribute__ ((naked, used, section (".init1")));
+void stack_paint(void)
+{
+  asm volatile("	ldi r30, lo8(_end)\n"
+	       "	ldi r31, hi8(_end)\n"
+	       "	ldi r24, %0\n"
+	       "	ldi r25, hi8(__stack)\n"
+	       "	rjmp 2f\n"
+	       "1:	st Z+, r24\n"
+	       "2:	cpi r30, lo8(__stack)\n"
+	       "	cpc r31, r25\n"
+	       "	brlo 1b\n"
+	       "	breq 1b\n"
+	       : : "M" (STACK_CANARY));
+}
+
+/* Bytes of stack that have never been used */
+static uint16_t stack_unused(void)
+{
+  const uint8_t *p = &_end;
+
+  while (p <= &__stack && *p == STACK_CANARY)
+    p++;
+
+  return p - &_end;
+}
+
+/* Bytes between the end of static data and the top of RAM */
+static uint16_t stack_size(void)
+{
+  return &__stack - &_end + 1;
+}
+
+/*
+ * Watchdog bookkeeping.  Each kick records its source line, so the
+ * longest gap between kicks can be pinned to the kicks either side of
+ * it.  This lives in .noinit to survive the watchdog reset it is meant
+ * to explain; dog_report() prints it at the next boot.  Gaps are timed
+ * with milliseconds, which stops while asleep on battery.
+ */
+#define DOG_MAGIC	0xd06e
+
+#define DOG_ALARMING	0x01	/* state bits at the last kick */
+#define DOG_ALARM_ON	0x02
+#define DOG_SNOOZING	0x04
+#define DOG_ASLEEP	0x08
+#define DOG_MARQUEE	0x10
+
+static struct dog {
+  uint16_t magic;
+  uint16_t site;		/* line of the last kick */
+  uint16_t at;			/* and when, in milliseconds */
+  uint32_t secs;		/* clock_secs then */
+  uint8_t state;		/* DOG_* */
+  uint16_t worst;		/* longest gap so far, ms */
+  uint16_t worst_from;		/* lines of the kicks either side of it */
+  uint16_t worst_to;
+} dog __attribute__((section(".noinit")));
+
+#define kickthedog()	dog_kick(__LINE__)
+
 // we reset the watchdog timer 
-static void kickthedog(void) {
+static void dog_kick(uint16_t line)
+{
+  uint16_t t = now();
+  uint16_t gap = t - dog.at;
+
   wdt_reset();
+
+  if (gap > dog.worst) {
+    dog.worst = gap;
+    dog.worst_from = dog.site;
+    dog.worst_to = line;
+  }
+  dog.site = line;
+  dog.at = t;
+  dog.secs = clock_secs;
+  dog.state = (alarming ? DOG_ALARMING : 0) |
+    (alarm_on ? DOG_ALARM_ON : 0) |
+    (snoozetimer ? DOG_SNOOZING : 0) |
+    (sleepmode ? DOG_ASLEEP : 0) |
+    (marquee_len ? DOG_MARQUEE : 0);
+}
+
+/* After a watchdog reset, say what was last seen; then start afresh */
+static void dog_report(uint8_t mcustate)
+{
+  if ((mcustate & _BV(WDRF)) && dog.magic == DOG_MAGIC) {
+    struct timedate td;
+
+    secs_to_timedate(dog.secs, &td);
+    putstring("watchdog reset: last kick line ");
+    uart_putw_dec(dog.site);
+    putstring(" at ");
+    uart_putw_dec(td.time.h);
+    uart_putc(':');
+    uart_putw_dec(td.time.m);
+    uart_putc(':');
+    uart_putw_dec(td.time.s);
+    putstring(" state ");
+    uart_putc_hex(dog.state);
+    putstring_nl("");
+    putstring("longest gap ");
+    uart_putw_dec(dog.worst);
+    putstring("ms, lines ");
+    uart_putw_dec(dog.worst_from);
+    uart_putc('-');
+    uart_putw_dec(dog.worst_to);
+    putstring_nl("");
+  }
+
+  memset(&dog, 0, sizeof(dog));
+  dog.magic = DOG_MAGIC;
+  dog.at = now();
+}
+
+/*
+ * Boot progress.  main() runs Timer1 at F_CPU/64 from reset until
+ * speaker_init() takes it over, and notes the count as each phase of
+ * the boot ends; the serial 'B' command reads them back.  Phases a
+ * battery boot skips stay 0.
+ */
+#define BOOT_POWER	0	/* power source known, I/O set up */
+#define BOOT_CLOCK	1	/* time restored from EEPROM */
+#define BOOT_FRAME	2	/* time on the tube, boost running */
+#define BOOT_DONE	3	/* everything else, just before the speaker */
+#define BOOT_NPHASES	4
+
+#define BOOT_US		(64000000UL / F_CPU)	/* us per count */
+
+static uint16_t boot_times[BOOT_NPHASES];
+
+static void boot_mark(uint8_t phase)
+{
+  boot_times[phase] = TCNT1;
 }
 
 static inline uint16_t time_since(uint16_t then)
@@ -173,21 +389,30 @@ Button state machine:
 digraph switch {
 	open -> closed [label="button\npressed"];
 
-	closed -> latched [label="held for\ndebounce\nrept=init"];
-	closed -> open [label="button\nreleased"];
+	closed -> latched [label="still pressed\nat debounce\ndeadline\nrept=init"];
+	closed -> open [label="released at\ndebounce\ndeadline"];
 
-	sampled -> latched [label="button repeat\ntimeout\nrept=rate"];
-	sampled -> open [label="button\nreleased"];
+	sampled -> latched [label="button repeat\ntimeout\nrept shrinks"];
+	sampled -> open [label="released at\ndebounce\ndeadline"];
 
 	latched -> sampled [label="state\nsampled"];
-	latched -> open [label="button\nreleased"];
+	latched -> open [label="released at\ndebounce\ndeadline"];
 }
+
+The first edge on a button's pin masks that pin's interrupt and arms
+a debounce deadline; the rest of the bounce is never seen.  When the
+deadline passes, the pin is sampled and its interrupt re-enabled.
 */
 
 #define DEBOUNCE	20	/* ms button must be pressed to be noticed */
 
 #define REPT_INIT	800	/* ms before repeat starts */
-#define REPT_RATE	60	/* ms between repeats */
+#define REPT_RATE	60	/* ms between first repeats */
+#define REPT_MIN	20	/* ms between repeats at full speed */
+#define REPT_ACCEL	3	/* each repeat is 1/2^REPT_ACCEL quicker */
+
+#define REPT_STEPUP	8	/* repeats before the step size doubles */
+#define REPT_MAXSTEP	4	/* largest step size */
 
 #define NBUTTONS	4
 
@@ -199,8 +424,11 @@ digraph switch {
 
 static uint8_t button_state;		/* state for each button */
 static uint16_t button_time[NBUTTONS];	/* timestamp for current state */
+static uint16_t button_deadline[NBUTTONS]; /* when to sample a masked pin */
+static volatile uint8_t button_armed;	/* buttons waiting for a deadline */
 static uint16_t button_lastpress;	/* timestamp last button entered LATCHED */
 static uint16_t button_repeat;		/* timeout for NEXT button repeat */
+static uint8_t button_repeats;		/* repeats since NEXT was pressed */
 
 /* button states */
 #define BS_OPEN		0	/* not pressed */
@@ -221,9 +449,154 @@ static uint16_t button_repeat;		/* timeout for NEXT button repeat */
 
 #define BMASK(b)	BSTATE(b, BS_MASK)
 
+/*
+ * Gesture events.  The FSM queues a timestamped event for each of
+ * these as it happens; the UI takes them with button_event().  If the
+ * UI doesn't keep up, the oldest events are dropped.
+ */
+#define BE_PRESS	0	/* press has settled */
+#define BE_RELEASE	1	/* release has settled */
+#define BE_LONG		2	/* held for LONGPRESS ms */
+#define BE_DOUBLE	3	/* pressed within DOUBLEPRESS ms of release */
+#define BE_REPEAT	4	/* NEXT auto-repeat */
+
+#define BEVENT(b, e)	(((b) << 4) | (e))
+
+#define LONGPRESS	1000	/* ms held for a long-press */
+#define DOUBLEPRESS	300	/* ms between release and press for a double */
+
+#define NEVENTS		8	/* must be a power of 2 */
+
+struct button_event {
+  uint8_t ev;			/* BEVENT(button, type) */
+  uint16_t time;
+};
+
+static struct button_event button_events[NEVENTS];
+static uint8_t button_ev_head, button_ev_tail; /* free-running indices */
+static uint8_t button_longwait;	/* held buttons not yet long-pressed */
+static uint8_t button_released;	/* button_time[] is a release, for doubles */
+
+/* Queue an event.  Called with interrupts disabled. */
+static void button_emit(uint8_t button, uint8_t type)
+{
+  struct button_event *e = &button_events[button_ev_head++ % NEVENTS];
+
+  e->ev = BEVENT(button, type);
+  e->time = now();
+
+  if ((uint8_t)(button_ev_head - button_ev_tail) > NEVENTS)
+    button_ev_tail++;		/* full; lose the oldest */
+}
+
+/* Take the oldest queued event; returns false if there are none */
+static uint8_t button_event(struct button_event *e)
+{
+  uint8_t ret = 0;
+
+  cli();
+  if (button_ev_tail != button_ev_head) {
+    *e = button_events[button_ev_tail++ % NEVENTS];
+    ret = 1;
+  }
+  sei();
+
+  return ret;
+}
+
+static void button_flush_events(void)
+{
+  cli();
+  button_ev_tail = button_ev_head;
+  sei();
+}
+
+/*
+ * Input latency, if LATSTATS.  A press is timestamped at its edge,
+ * from the pin-change interrupt; when it latches after debounce (a
+ * NEXT repeat latches too); when the UI samples it; and as the frames
+ * it leads to are published.  Each stage between gets a histogram of
+ * power-of-two millisecond buckets, read with the serial 'H' command.
+ */
+#define LAT_DEBOUNCE	0	/* edge -> latched */
+#define LAT_POLL	1	/* latched -> sampled by the UI */
+#define LAT_RESPOND	2	/* sampled -> first frame published */
+#define LAT_TRANS	3	/* first frame -> transition finished */
+#define LAT_NSTAGES	4
+#define LAT_NBUCKETS	12	/* 0, 1, 2-3, 4-7 ... 1024ms and up */
+
+static uint16_t lat_hist[LAT_NSTAGES][LAT_NBUCKETS];
+static uint16_t lat_edge[BUT_ALARM];	/* when each button went down */
+static uint16_t lat_latch[BUT_ALARM];	/* and when it latched */
+static uint16_t lat_mark;		/* when the last press was sampled */
+static uint8_t lat_pending;		/* 1: awaiting a frame, 2: a transition */
+
+static void lat_record(uint8_t stage, uint16_t ms)
+{
+  uint16_t *c;
+  uint8_t b = 0;
+
+  while (ms && b < LAT_NBUCKETS - 1) {
+    ms >>= 1;
+    b++;
+  }
+
+  c = &lat_hist[stage][b];
+  if (*c != 0xffff)
+    (*c)++;
+}
+
+/* A frame was published; last is true at the end of a transition */
+static void lat_frame(uint8_t last)
+{
+  uint16_t t = now();
+
+  if (lat_pending == 1) {
+    lat_record(LAT_RESPOND, t - lat_mark);
+    lat_mark = t;
+    lat_pending = 2;
+  }
+
+  if (last) {
+    lat_record(LAT_TRANS, t - lat_mark);
+    lat_pending = 0;
+  }
+}
+
+/* Raw (undebounced) pin state for a button; true if pressed */
+static uint8_t button_pin(uint8_t button)
+{
+  switch (button) {
+  case BUT_MENU:	return !(PIND & _BV(BUTTON1));
+  case BUT_SET:		return !(PINB & _BV(BUTTON2));
+  case BUT_NEXT:	return !(PIND & _BV(BUTTON3));
+  default:		return !!(ALARM_PIN & _BV(ALARM));
+  }
+}
+
+/* Enable or disable the pin-change (or INT0) interrupt for a button */
+static void button_irq(uint8_t button, uint8_t on)
+{
+  volatile uint8_t *reg;
+  uint8_t bit;
+
+  switch (button) {
+  case BUT_MENU:	reg = &PCMSK2; bit = _BV(PCINT21); break;
+  case BUT_SET:		reg = &PCMSK0; bit = _BV(PCINT0); break;
+  case BUT_NEXT:	reg = &PCMSK2; bit = _BV(PCINT20); break;
+  default:		reg = &EIMSK; bit = _BV(INT0); break;
+  }
+
+  if (on)
+    *reg |= bit;
+  else
+    *reg &= ~bit;
+}
+
 /*
  * We got an interrupt for a button; update state.  Expected to be
- * called with button interrupt source masked.
+ * called with interrupts disabled.  If the pin disagrees with the
+ * debounced state, mask it and arm a debounce deadline.
  * button = button number (0 - NBUTTONS)
  */
 static void button_change_intr(uint8_t button, uint8_t state)
@@ -234,75 +607,135 @@ static void button_change_intr(uint8_t button, uint8_t state)
   bmask = BMASK(button);
   bstate = button_state & bmask;
 
-  if (state) {
-    /* pressed, so open->closed, anything else unaffected */
-    if (bstate == BOPEN(button)) {
-      bstate = BCLOSED(button);
-      /* record press time for debounce */
+  if (!state == (bstate == BOPEN(button)))
+    return;			/* no change */
+
+  button_irq(button, 0);
+  button_deadline[button] = now() + DEBOUNCE;
+  button_armed |= _BV(button);
+
+  /* pressed, so open->closed, anything else waits for the deadline */
+  if (bstate == BOPEN(button)) {
+    button_state = (button_state & ~bmask) | BCLOSED(button);
+    if (LATSTATS && button < BUT_ALARM)
+      lat_edge[button] = now();
+  }
+}
+
+/*
+ * Sample a button whose debounce deadline has passed, and re-enable
+ * its interrupt.  Returns the new state.  Called with interrupts
+ * disabled.
+ */
+static uint8_t button_settle(uint8_t button, uint8_t s)
+{
+  button_armed &= ~_BV(button);
+
+  /* the alarm switch is only debounced; it makes no gestures */
+  if (button == BUT_ALARM) {
+    if (!button_pin(button))
+      s = BS_OPEN;
+    else if (s == BS_CLOSED)
+      s = BS_LATCHED;
+  } else if (!button_pin(button)) {
+    if (s != BS_CLOSED) {
+      button_emit(button, BE_RELEASE);
+      /* record release time for double-press */
       button_time[button] = now();
+      button_released |= _BV(button);
     }
-  } else {
-    /* button released, so anything->open */
-    bstate = BOPEN(button);
+    button_longwait &= ~_BV(button);
+    s = BS_OPEN;
+  } else if (s == BS_CLOSED) {
+    s = BS_LATCHED;
+    button_emit(button, BE_PRESS);
+    /*
+     * Can alias once now() wraps (~1 min), as with button_timeout();
+     * at worst a slow second press counts as a double.  The first
+     * press since boot has no release to pair with.
+     */
+    if ((button_released & _BV(button)) &&
+	time_since(button_time[button]) < DOUBLEPRESS)
+      button_emit(button, BE_DOUBLE);
+    button_released &= ~_BV(button);
+    /* record latched time for repeat */
+    button_time[button] = now();
+    button_repeat = REPT_INIT;
+    button_repeats = 0;
+    if (LATSTATS) {
+      lat_record(LAT_DEBOUNCE, time_since(lat_edge[button]));
+      lat_latch[button] = now();
+    }
+    /* button_deadline[] now marks when the press settled */
+    button_longwait |= _BV(button);
   }
 
-  /* update state */
-  button_state = (button_state & ~bmask) | bstate;
+  button_state = (button_state & ~BMASK(button)) | BSTATE(button, s);
+  button_irq(button, 1);
+
+  /* catch any change that happened while the pin was masked */
+  button_change_intr(button, button_pin(button));
+
+  return s;
+}
+
+/*
+ * True if the button FSM has timed work to do: a debounce deadline,
+ * a held button waiting for long-press, or NEXT auto-repeating.
+ */
+static inline uint8_t button_busy(void)
+{
+  return button_armed || button_longwait ||
+    (button_state & BMASK(BUT_NEXT)) == BSAMPLED(BUT_NEXT);
 }
 
-/* Called every millisecond(ish) to update button state */
+/* Called every millisecond(ish) while button_busy() to update state */
 static void button_state_update(void)
 {
   uint8_t i;
-  uint8_t bs;
-  uint16_t timeout, rept;
-
-  cli();
 
-  bs = button_state;
   for (i = 0; i < NBUTTONS; i++) {
-    uint8_t s = bs & BS_MASK;
-    switch (s) {
-    case BS_OPEN:
-    case BS_LATCHED:
-      /* no time-based state changes */
-      break;
+    uint8_t s;
+
+    cli();
+    s = (button_state >> (i * BS_LOG_NSTATES)) & BS_MASK;
+
+    if (button_armed & _BV(i)) {
+      if ((int16_t)(now() - button_deadline[i]) >= 0) {
+	s = button_settle(i, s);
 
-    /* closed and sampled transition to latched with appropriate timeout */
-    case BS_CLOSED:
-      timeout = DEBOUNCE;
-      rept = REPT_INIT;		/* closed->latched reset initial repeat timeout */
-      goto timelatch;
-
-    case BS_SAMPLED:
-      timeout = 0;		/* no repeat for MENU and SET */
-      if (i == BUT_NEXT) {
-	timeout = button_repeat;
-	rept = REPT_RATE;
+	/* the main loop turns the alarm off; no UI from here */
+	if (i == BUT_ALARM && s == BS_OPEN)
+	  alarm_switched = 1;
+      }
+    } else {
+      if ((button_longwait & _BV(i)) &&
+	  time_since(button_deadline[i]) >= LONGPRESS) {
+	button_longwait &= ~_BV(i);
+	button_emit(i, BE_LONG);
       }
-      goto timelatch;
 
-    timelatch:
-      if (timeout && time_since(button_time[i]) >= timeout) {
-	s = BS_LATCHED;
+      if (i == BUT_NEXT && s == BS_SAMPLED &&
+	  time_since(button_time[i]) >= button_repeat) {
+	/* no repeat for MENU and SET */
+	button_state = (button_state & ~BMASK(i)) | BLATCHED(i);
+	button_emit(i, BE_REPEAT);
 	/* record latched time for repeat */
 	button_time[i] = now();
-	/* update repeat rate for current state */
-	button_repeat = rept;
+	if (LATSTATS)
+	  lat_latch[i] = button_time[i];
+	/* repeat a little faster each time, up to REPT_MIN */
+	if (!button_repeats)
+	  button_repeat = REPT_RATE;
+	else if (button_repeat > REPT_MIN)
+	  button_repeat -= button_repeat >> REPT_ACCEL;
+	if (button_repeats < 255)
+	  button_repeats++;
       }
-      break;
     }
 
-    /* shift out just-processed state */
-    bs >>= BS_LOG_NSTATES;
-
-    /* plonk in newly updated state */
-    bs |= s << (BS_LOG_NSTATES * (NBUTTONS-1));
+    sei();
   }
-
-  button_state = bs;
-
-  sei();
 }
 
 /*
@@ -339,15 +772,37 @@ static uint8_t button_sample(uint8_t button)
 
     button_lastpress = now();
 
+    if (LATSTATS && button < BUT_ALARM) {
+      lat_record(LAT_POLL, time_since(lat_latch[button]));
+      lat_mark = button_lastpress;
+      lat_pending = 1;
+    }
+
     sei();
 
     tick();
+    dark_wakeup();
   } else
     sei();
 
   return ret;
 }
 
+/*
+ * Step size for the current NEXT auto-repeat: doubles every
+ * REPT_STEPUP repeats, so long ranges can be crossed quickly.
+ */
+static uint8_t button_step(void)
+{
+  uint8_t n = button_repeats / REPT_STEPUP;
+  uint8_t step = 1;
+
+  while (n-- && step < REPT_MAXSTEP)
+    step <<= 1;
+
+  return step;
+}
+
 /************************* LOW LEVEL DISPLAY ************************/
 
 // Setup SPI
@@ -355,6 +810,36 @@ static void vfd_init(void) {
   SPCR  = _BV(SPE) | _BV(MSTR) | _BV(SPR0);
 }
 
+/*
+ * Turn the display off for dark hours, or back on; from the main loop
+ * only, since waking restarts the VFD and the boost.  Timer0 keeps
+ * running, since it is also the millisecond tick, but the boost PWM
+ * is disconnected, the mux interrupt skips its SPI work and the VFD
+ * supply is switched off.
+ */
+static volatile uint8_t dark;
+
+static void display_dark(uint8_t off)
+{
+  if (off == dark)
+    return;
+
+  if (off) {
+    dark = 1;			/* mux stops before SPI does */
+    TCCR0A &= ~_BV(COM0A1);
+    BOOST_PORT &= ~_BV(BOOST);	// pull boost fet low
+    VFDSWITCH_PORT |= _BV(VFDSWITCH);
+    SPCR &= ~_BV(SPE);
+    VFDCLK_PORT &= ~_BV(VFDCLK) & ~_BV(VFDDATA);
+  } else {
+    vfd_init();
+    VFDSWITCH_PORT &= ~_BV(VFDSWITCH);
+    boost_restart();
+    TCCR0A |= _BV(COM0A1);
+    dark = 0;
+  }
+}
+
 // Send 1 byte via SPI
 static void spi_xfer(uint8_t c) {
 
@@ -557,23 +1042,88 @@ static uint8_t scroll_left(uint8_t *statep)
 
 static uint8_t flip(uint8_t *unused)
 {
-  memcpy(output_display, display, sizeof(output_display));
+  memcpy(output_display, display, DISPLAYSIZE);
   return 0;
 }
 
+/* Make the back frame visible; a single byte store, so atomic */
+static void publish_frame(void)
+{
+  front ^= 1;
+  output_display = frames[front ^ 1];
+}
+
+static void marquee_stop(void)
+{
+  marquee_len = 0;
+}
+
+/* Scroll the first n characters of marquee[]; digits 1-8 show them */
+static void marquee_start(uint8_t n)
+{
+  cli();
+  marquee_pos = 0;
+  marquee_laps = 0;
+  marquee_tick = -MARQUEE_HOLD;
+  marquee_len = n;
+  sei();
+}
+
+/* Advance the marquee; from the mux interrupt, once a millisecond */
+static void marquee_step(void)
+{
+  if (++marquee_tick < MARQUEE_RATE)
+    return;
+  marquee_tick = 0;
+
+  if (++marquee_pos >= marquee_len + MARQUEE_GAP) {
+    marquee_pos = 0;
+    marquee_tick = -MARQUEE_HOLD;
+    marquee_laps++;
+  }
+}
+
+/* Segments the marquee puts on a digit */
+static uint8_t marquee_seg(uint8_t digit)
+{
+  uint8_t i = marquee_pos + digit - 1;
+
+  if (i >= marquee_len + MARQUEE_GAP)
+    i -= marquee_len + MARQUEE_GAP;
+
+  return i < marquee_len ? marquee[i] : 0;
+}
+
+/* Leave what's shown for ms, and for a whole pass if it's scrolling */
+static void display_hold(uint16_t ms)
+{
+  delayms(ms);
+  while (marquee_len && !marquee_laps) {
+    kickthedog();
+    delayms(50);
+  }
+}
+
 static void flip_display(transition_t* trans)
 {
   uint8_t state = 0;
   uint8_t delay;
 
-  /* Disable interrupts while generating new output to prevent flickers */
-  cli();
-  while((delay = (*trans)(&state))) {
-    sei();
+  /* anything new on the tube replaces a scrolling message */
+  marquee_stop();
+
+  for (;;) {
+    /* each step starts from what's on the tube now */
+    memcpy(output_display, frames[front], DISPLAYSIZE);
+    delay = (*trans)(&state);
+    publish_frame();
+    if (LATSTATS && lat_pending)
+      lat_frame(!delay);
+
+    if (!delay)
+      break;
     delayms(delay);
-    cli();
   }
-  sei();
 }
 
 // called @ (F_CPU/256) = ~30khz (31.25 khz)
@@ -591,55 +1141,43 @@ SIGNAL (TIMER0_OVF_vect) {
   // ok its not really 1ms but its like within 10% :)
   milliseconds++;
 
-  // update latched and repeat state of buttons
-  button_state_update();
+  // update debounce and repeat state of buttons, if any need it
+  if (button_busy())
+    button_state_update();
+
+  if (marquee_len)
+    marquee_step();
 
   // Cycle through each digit in the display
   if (currdigit >= DISPLAYSIZE)
     currdigit = 0;
 
   // Set the current display's segments
-  setdisplay(currdigit, output_display[currdigit]);
-  // and go to the next
-  currdigit++;
-
-  // check if we should have the alarm on
-  if (alarming && !snoozetimer) {
-    alarmdiv++;
-    if (alarmdiv > ALARM_DIVIDER) {
-      alarmdiv = 0;
-    } else {
-      return;
-    }
-    // This part only gets reached at 1Hz
-
-    // This sets the buzzer frequency
-    ICR1 = 250;
-    OCR1A = OCR1B = ICR1/2;
+  if (!dark) {
+    uint8_t seg = frames[front][currdigit];
 
-    // ok alarm is ringing!
-    if (alarming & 0xF0) { // top bit indicates pulsing alarm state
-      alarming &= ~0xF0;
-      TCCR1B &= ~_BV(CS11); // turn buzzer off!
-    } else {
-      alarming |= 0xF0;
-      TCCR1B |= _BV(CS11); // turn buzzer on!
-    }
+    if (marquee_len && currdigit)
+      seg = marquee_seg(currdigit);
+    setdisplay(currdigit, seg);
   }
-  
+  // and go to the next
+  currdigit++;
 }
 
 // We use the pin change interrupts to detect when buttons are pressed
 
 // This interrupt detects switches 1 and 3
+// (masked pins are skipped; they're waiting out their debounce)
 SIGNAL(PCINT2_vect) {
-  button_change_intr(0, !(PIND & _BV(BUTTON1)));
-  button_change_intr(2, !(PIND & _BV(BUTTON3)));
+  if (PCMSK2 & _BV(PCINT21))
+    button_change_intr(BUT_MENU, button_pin(BUT_MENU));
+  if (PCMSK2 & _BV(PCINT20))
+    button_change_intr(BUT_NEXT, button_pin(BUT_NEXT));
 }
 
 // Just button #2
 SIGNAL(PCINT0_vect) {
-  button_change_intr(1, !(PINB & _BV(BUTTON2)));
+  button_change_intr(BUT_SET, button_pin(BUT_SET));
 }
 
 // This will calculate leapyears, give it the year
@@ -667,112 +1205,739 @@ static uint8_t dotw(const struct date *date)
 	  (year/400) + 1) % 7;
 }
 
-static void increment_time(struct timedate *td)
+/* Days since 2000-01-01; good for 2000-2099, where every 4th year is leap */
+static uint16_t daynum(uint8_t y, uint8_t m, uint8_t d)
 {
-  td->time.s++;             // one second has gone by
-
-  // a minute!
-  if (td->time.s >= 60) {
-    td->time.s = 0;
-    td->time.m++;
-  }
-
-  // an hour...
-  if (td->time.m >= 60) {
-    td->time.m = 0;
-    td->time.h++; 
-    // lets write the time to the EEPROM
-    eeprom_write_byte((uint8_t *)EE_HOUR, td->time.h);
-    eeprom_write_byte((uint8_t *)EE_MIN, td->time.m);
-  }
+  static const uint16_t monthdays[] PROGMEM = {
+    0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334
+  };
+  uint16_t n;
 
-  // a day....
-  if (td->time.h >= 24) {
-    td->time.h = 0;
-    td->date.d++;
-    eeprom_write_byte((uint8_t *)EE_DAY, td->date.d);
-  }
+  n = (uint16_t)y * 365 + (y + 3) / 4 + pgm_read_word(&monthdays[m - 1]) + d - 1;
+  if (m > 2 && !(y % 4))
+    n++;
 
-  // a full month!
-  // we check the leapyear and date to verify when its time to roll over months
-  if ((td->date.d > 31) ||
-      ((td->date.d == 31) && ((td->date.m == 4)||(td->date.m == 6)||(td->date.m == 9)||(td->date.m == 11))) ||
-      ((td->date.d == 30) && (td->date.m == 2)) ||
-      ((td->date.d == 29) && (td->date.m == 2) && !leapyear(2000+td->date.y))) {
-    td->date.d = 1;
-    td->date.m++;
-    eeprom_write_byte((uint8_t *)EE_MONTH, td->date.m);
-  }
-  
-  // HAPPY NEW YEAR!
-  if (td->date.m >= 13) {
-    td->date.y++;
-    td->date.m = 1;
-    eeprom_write_byte((uint8_t *)EE_YEAR, td->date.y);
-  }
+  return n;
 }
 
-static void load_brite(void)
+/* Day of the week for a daynum(), Sunday = 0 */
+static uint8_t weekday(uint16_t day)
 {
-  morning = eeprom_read_byte((unsigned char *)EE_MORNINGHR);
-  if (morning < 0 || morning > 12)
-    morning = 6;
+  return (day + 6) % 7;		/* 2000-01-01 was a Saturday */
+}
 
-  evening = eeprom_read_byte((unsigned char *)EE_EVENINGHR);
-  if (evening < 12 || evening > 23)
-    evening = 18;
+/* Year containing a daynum() */
+static uint8_t year_of(uint16_t day)
+{
+  uint8_t y = day / 365;
 
-  daybrite = eeprom_read_byte((unsigned char *)EE_DAYBRITE);
-  if (daybrite < BRITE_MIN || daybrite > BRITE_MAX)
-    daybrite = BRITE_MAX;
+  /* leap days can push it one year too far, no more */
+  if (daynum(y, 1, 1) > day)
+    y--;
 
-  nightbrite = eeprom_read_byte((unsigned char *)EE_NIGHTBRITE);
-  if (nightbrite < BRITE_MIN || nightbrite > BRITE_MAX)
-    nightbrite = BRITE_MIN;
+  return y;
 }
 
-static void save_brite(void)
+static uint32_t timedate_secs(const struct timedate *td)
+{
+  return daynum(td->date.y, td->date.m, td->date.d) * 86400UL +
+    td->time.h * 3600UL + td->time.m * 60 + td->time.s;
+}
+
+static void secs_to_timedate(uint32_t t, struct timedate *td)
+{
+  uint16_t day = t / 86400;
+  uint32_t s = t % 86400;
+  uint8_t m;
+
+  td->time.h = s / 3600;
+  td->time.m = s / 60 % 60;
+  td->time.s = s % 60;
+
+  td->date.y = year_of(day);
+  for (m = 12; daynum(td->date.y, m, 1) > day; m--)
+    ;
+  td->date.m = m;
+  td->date.d = day - daynum(td->date.y, m, 1) + 1;
+}
+
+/* Read clock_secs; safe with interrupts enabled or not */
+static uint32_t clock_now(void)
+{
+  uint8_t sreg = SREG;
+  uint32_t t;
+
+  cli();
+  t = clock_secs;
+  SREG = sreg;
+
+  return t;
+}
+
+/*
+ * Daylight saving rules: each changes the clock by 'shift' hours at
+ * 'hour' local time on a Sunday of 'month', the 'week'th one or, if
+ * 'week' is 0, the last.  EU times are for Central European Time.
+ */
+struct dst_rule {
+  uint8_t month, week, hour;
+  int8_t shift;
+};
+
+static const struct dst_rule dst_rules[][2] PROGMEM = {
+  [DST_US - 1] = { { 3, 2, 2, 1 }, { 11, 1, 2, -1 } },
+  [DST_EU - 1] = { { 3, 0, 2, 1 }, { 10, 0, 3, -1 } },
+};
+
+static uint32_t dst_time(uint8_t y, const struct dst_rule *r)
+{
+  uint8_t m = pgm_read_byte(&r->month);
+  uint8_t week = pgm_read_byte(&r->week);
+  uint16_t day;
+
+  if (week) {
+    day = daynum(y, m, 1);
+    day += (7 - weekday(day)) % 7 + 7 * (week - 1);
+  } else {
+    /* no rule is in December, so m + 1 is fine */
+    day = daynum(y, m + 1, 1) - 1;
+    day -= weekday(day);
+  }
+
+  return day * 86400UL + pgm_read_byte(&r->hour) * 3600UL;
+}
+
+/*
+ * Work out the first daylight saving change after 'after', so that
+ * clock_update() only has to compare it with clock_secs.
+ */
+static void dst_update(uint32_t after)
+{
+  const struct dst_rule *r;
+  uint8_t y, last, i;
+
+  dst_next = NEVER;
+  if (dst_mode == DST_OFF)
+    return;
+
+  /* the next change is this year or early next */
+  y = year_of(after / 86400);
+  for (last = y + 1; y <= last && y < 100; y++) {
+    r = dst_rules[dst_mode - 1];
+    for (i = 0; i < 2; i++, r++) {
+      uint32_t t = dst_time(y, r);
+
+      if (t > after && t < dst_next) {
+	dst_next = t;
+	dst_shift = pgm_read_byte(&r->shift);
+      }
+    }
+  }
+}
+
+/*
+ * Work out when an alarm next goes off after 'after'.  Done whenever
+ * the alarms or the clock change, so the check each second is a single
+ * comparison however many alarms there are.
+ */
+static void alarm_update(uint32_t after)
+{
+  uint8_t n;
+
+  alarm_next = NEVER;
+
+  for (n = 0; n < NALARMS; n++) {
+    uint16_t day = after / 86400;
+    uint8_t i;
+
+    /* today's might still be to come, otherwise within a week */
+    for (i = 0; i < 8 && alarms_days[n]; i++, day++) {
+      uint32_t t = day * 86400UL + alarms[n].h * 3600UL + alarms[n].m * 60;
+
+      if ((alarms_days[n] & _BV(weekday(day))) && t > after) {
+	if (t < alarm_next) {
+	  alarm_next = t;
+	  alarm_due = n;
+	}
+	break;
+      }
+    }
+  }
+}
+
+static void increment_time(struct timedate *td)
+{
+  td->time.s++;             // one second has gone by
+
+  // a minute!
+  if (td->time.s >= 60) {
+    td->time.s = 0;
+    td->time.m++;
+  }
+
+  // an hour...
+  if (td->time.m >= 60) {
+    td->time.m = 0;
+    td->time.h++; 
+  }
+
+  // a day....
+  if (td->time.h >= 24) {
+    td->time.h = 0;
+    td->date.d++;
+  }
+
+  // a full month!
+  // we check the leapyear and date to verify when its time to roll over months
+  if ((td->date.d > 31) ||
+      ((td->date.d == 31) && ((td->date.m == 4)||(td->date.m == 6)||(td->date.m == 9)||(td->date.m == 11))) ||
+      ((td->date.d == 30) && (td->date.m == 2)) ||
+      ((td->date.d == 29) && (td->date.m == 2) && !leapyear(2000+td->date.y))) {
+    td->date.d = 1;
+    td->date.m++;
+  }
+  
+  // HAPPY NEW YEAR!
+  if (td->date.m >= 13) {
+    td->date.y++;
+    td->date.m = 1;
+  }
+}
+
+/*
+ * Bring timedate up to clock_secs.  Usually only a second or two has
+ * passed, so step it along; otherwise convert it from scratch.
+ */
+static void timedate_sync(void)
+{
+  uint32_t now = clock_now();
+  uint32_t delta = now - timedate_at;
+
+  if (suspend_update || !delta)
+    return;
+
+  if (delta < 256) {
+    while (delta--)
+      increment_time(&timedate);
+  } else
+    secs_to_timedate(now, &timedate);
+
+  timedate_at = now;
+}
+
+/* Set the clock; the deadlines need clock_resync() afterwards */
+static void clock_set_secs(uint32_t t)
+{
+  cli();
+  clock_secs = t;
+  sei();
+
+  clock_last = t;
+  secs_to_timedate(t, &timedate);
+  timedate_at = t;
+}
+
+/*
+ * Drift learning.  Deliberate corrections of the time say how far the
+ * clock wanders, with drift as it is, so drift can be moved towards
+ * the rate that would have kept it right.  Corrections are added up
+ * until LEARN_MIN_SECS have passed, long enough that a second's error
+ * in setting the time hardly matters.  One too big to be drift (a new
+ * time zone, or a guess after losing power) starts the count again.
+ */
+#define LEARN_MIN_SECS	(7 * 86400UL)	/* shortest interval to learn from */
+#define LEARN_MAX_ERR	(5 * 60 * 128L)	/* ticks; more isn't drift */
+#define LEARN_SHIFT	1		/* go 1/2^n of the way each time */
+
+static uint32_t learn_from = NEVER;	/* clock_secs the count started */
+static int32_t learn_err;		/* RTC ticks corrected since */
+
+/* The clock is being set to t, err RTC ticks from where it was */
+static void drift_learn(int32_t err, uint32_t t)
+{
+  uint32_t now = clock_now();
+  int32_t adj;
+
+  learn_err += err;
+  if (timeunknown || now <= learn_from ||
+      learn_err >= LEARN_MAX_ERR || learn_err <= -LEARN_MAX_ERR) {
+    learn_from = t;
+    learn_err = 0;
+  } else if (now - learn_from >= LEARN_MIN_SECS) {
+    /* ticks an hour the clock ran fast by; a slow clock needs less */
+    adj = -learn_err * 3600 / (int32_t)(now - learn_from);
+    adj = drift + adj / (1 << LEARN_SHIFT);
+    if (adj > DRIFT_MAX)
+      adj = DRIFT_MAX;
+    else if (adj < DRIFT_MIN)
+      adj = DRIFT_MIN;
+    if (adj != drift) {
+      drift = adj;
+      eeprom_write_byte((uint8_t *)EE_DRIFT, drift);
+    }
+
+    learn_from = t;
+    learn_err = 0;
+  }
+
+  eeprom_write_dword((uint32_t *)EE_LEARNFROM, learn_from);
+  eeprom_write_dword((uint32_t *)EE_LEARNERR, learn_err);
+}
+
+/* The clock moved by secs without being wrong (DST, a new date) */
+static void learn_shift(int32_t secs)
+{
+  if (learn_from == NEVER)
+    return;
+  learn_from += secs;
+  eeprom_write_dword((uint32_t *)EE_LEARNFROM, learn_from);
+}
+
+/*
+ * Back up the time to EEPROM each hour, and the date as it rolls over.
+ * This goes by the clock, not timedate, which a set menu may be
+ * part way through editing.
+ */
+static void save_hourly(uint32_t now)
+{
+  struct timedate td;
+
+  secs_to_timedate(now, &td);
+
+  eeprom_write_byte((uint8_t *)EE_HOUR, td.time.h);
+  eeprom_write_byte((uint8_t *)EE_MIN, td.time.m);
+  if (td.time.h)
+    return;
+
+  eeprom_write_byte((uint8_t *)EE_DAY, td.date.d);
+  if (td.date.d != 1)
+    return;
+
+  eeprom_write_byte((uint8_t *)EE_MONTH, td.date.m);
+  if (td.date.m != 1)
+    return;
+
+  eeprom_write_byte((uint8_t *)EE_YEAR, td.date.y);
+}
+
+// Back up minutes and seconds when the power source changes; called
+// from the comparator interrupt
+static void save_minsec(void)
+{
+  uint16_t s = clock_secs % 3600;
+
+  eeprom_write_byte((uint8_t *)EE_MIN, s / 60);
+  eeprom_write_byte((uint8_t *)EE_SEC, s % 60);
+}
+
+static void load_brite(void)
+{
+  morning = eeprom_read_byte((unsigned char *)EE_MORNINGHR);
+  if (morning < 0 || morning > 12)
+    morning = 6;
+
+  evening = eeprom_read_byte((unsigned char *)EE_EVENINGHR);
+  if (evening < 12 || evening > 23)
+    evening = 18;
+
+  daybrite = eeprom_read_byte((unsigned char *)EE_DAYBRITE);
+  if (daybrite < BRITE_MIN || daybrite > BRITE_MAX)
+    daybrite = BRITE_MAX;
+
+  nightbrite = eeprom_read_byte((unsigned char *)EE_NIGHTBRITE);
+  if (nightbrite < BRITE_MIN || nightbrite > BRITE_MAX)
+    nightbrite = BRITE_MIN;
+
+  autobrite = eeprom_read_byte((unsigned char *)EE_AUTOBRITE) == 1;
+
+  dark_start = eeprom_read_byte((unsigned char *)EE_DARKSTART);
+  dark_end = eeprom_read_byte((unsigned char *)EE_DARKEND);
+  if (dark_start > 23 || dark_end > 23)
+    dark_start = dark_end = 0;
+}
+
+static void save_brite(void)
 {
   eeprom_write_byte((unsigned char *)EE_MORNINGHR, morning);
   eeprom_write_byte((unsigned char *)EE_EVENINGHR, evening);
   eeprom_write_byte((unsigned char *)EE_DAYBRITE, daybrite);
   eeprom_write_byte((unsigned char *)EE_NIGHTBRITE, nightbrite);
+  eeprom_write_byte((unsigned char *)EE_AUTOBRITE, autobrite);
+  eeprom_write_byte((unsigned char *)EE_DARKSTART, dark_start);
+  eeprom_write_byte((unsigned char *)EE_DARKEND, dark_end);
+}
+
+/* Work out whether the hour of 'now' is a dark one */
+static void dark_update(uint32_t now)
+{
+  uint8_t hour = now % 86400 / 3600;
+
+  if (dark_start <= dark_end)
+    dark_window = hour >= dark_start && hour < dark_end;
+  else
+    dark_window = hour >= dark_start || hour < dark_end;
+}
+
+/* Keep the display on for a while, from the main loop */
+static void dark_wakeup(void)
+{
+  dark_until = clock_now() + DARK_WAKE;
+  display_dark(0);
+}
+
+/*
+ * Ambient light.  The sensor on LIGHT_ADC is sampled every
+ * LIGHT_INTERVAL ms: adc_service() starts a conversion just before
+ * the main loop sleeps, and the ADC interrupt feeds the result through
+ * a first-order IIR filter.
+ *
+ * ADC noise reduction sleep would stop Timer0 too, which could leave
+ * the boost FET switched on for the whole conversion, so conversions
+ * run in idle sleep, where the CPU at least is quiet.
+ */
+#define LIGHT_INTERVAL	100	/* ms between samples */
+#define LIGHT_SHIFT	4	/* filter time constant, 2^n samples */
+#define LIGHT_NOSIM	0xffff
+
+static uint16_t light_acc;		/* filtered reading << LIGHT_SHIFT */
+static uint16_t light_sim = LIGHT_NOSIM; /* reading to use instead, for testing */
+static uint16_t light_due;
+
+/* acc moves 1/2^LIGHT_SHIFT of the way to each new reading */
+static void light_feed(uint16_t x)
+{
+  light_acc += x - (light_acc >> LIGHT_SHIFT);
+}
+
+/*
+ * Crystal temperature compensation.  A tuning-fork crystal runs slow
+ * either side of its turnover temperature, by TEMP_BETA ppb per degree
+ * squared.  With tempcomp on, the thermistor on TEMP_ADC is read every
+ * TEMP_INTERVAL ms and filtered like the light sensor, and each hour
+ * clock_update() takes the time the crystal is predicted to lose off
+ * the drift-corrected second.  The correction is worked in 1/256 RTC
+ * ticks, and what doesn't make a whole tick carries into later hours.
+ */
+#define TEMP_INTERVAL	1000	/* ms between samples */
+#define TEMP_SHIFT	3	/* filter time constant, 2^n samples */
+#define TEMP_NOSIM	INT16_MIN
+#define TEMP_T0		(25 * 16)	/* turnover, 1/16 degree C */
+#define TEMP_BETA	34	/* ppb per degree C squared */
+#define TEMP_PPB_TICK	2170	/* ppb in one RTC tick an hour */
+#define TEMP_DMAX	(40 * 16)	/* furthest from T0 we believe */
+#define TEMP_MIN	(-40 * 16)	/* ends of temp_table[] */
+#define TEMP_MAX	(125 * 16)
+
+static uint8_t tempcomp;		/* compensate for temperature */
+static int16_t temp_acc;		/* filtered 1/16 degrees << TEMP_SHIFT */
+static volatile uint8_t temp_seeded;	/* temp_acc has had a reading */
+static int16_t temp_sim = TEMP_NOSIM;	/* temperature to use instead */
+static int16_t temp_frac;		/* 1/256 ticks still to take off */
+static uint16_t temp_due;
+
+/*
+ * Temperature in 1/16 degree C at ADC readings 0, 64, 128 ... 1024,
+ * for a 10k B3950 NTC thermistor over a 10k resistor to ground.
+ */
+static const int16_t temp_table[] PROGMEM = {
+  -640, -410, -211, -75, 35, 132, 223, 311, 400,
+  492, 591, 702, 831, 994, 1221, 1626, 2000
+};
+
+static int16_t temp_from_adc(uint16_t x)
+{
+  uint8_t i = x >> 6;
+  int16_t lo = pgm_read_word(&temp_table[i]);
+  int16_t hi = pgm_read_word(&temp_table[i + 1]);
+
+  return lo + ((hi - lo) * (x & 63) >> 6);
+}
+
+static void temp_feed(int16_t t)
+{
+  /* start from the first reading, not from 0 C */
+  if (!temp_seeded) {
+    temp_acc = t << TEMP_SHIFT;
+    temp_seeded = 1;
+  } else
+    temp_acc += t - (temp_acc >> TEMP_SHIFT);
+}
+
+/* Filtered crystal temperature, 1/16 degree C */
+static int16_t temp_level(void)
+{
+  int16_t t;
+
+  cli();
+  t = temp_acc >> TEMP_SHIFT;
+  sei();
+
+  return t;
+}
+
+/* Time lost per hour at temperature t, in 1/256 RTC ticks */
+static int16_t temp_corr(int16_t t)
+{
+  int16_t d = t - TEMP_T0;
+
+  if (d > TEMP_DMAX)
+    d = TEMP_DMAX;
+  else if (d < -TEMP_DMAX)
+    d = -TEMP_DMAX;
+
+  return (int32_t)d * d * TEMP_BETA / TEMP_PPB_TICK;
+}
+
+/* Whole ticks to take off the coming hour; from clock_update() */
+static uint8_t temp_ticks(void)
+{
+  uint8_t whole;
+
+  if (!tempcomp || !temp_seeded)
+    return 0;
+
+  temp_frac += temp_corr(temp_level());
+  whole = temp_frac >> 8;
+  temp_frac &= 0xff;
+
+  return whole;
+}
+
+/*
+ * Boost regulation, if BOOST_FEEDBACK.  Every BOOST_INTERVAL ms the
+ * divider on BOOST_ADC is sampled and a PI controller moves the boost
+ * duty cycle towards boost_target.  The duty cycle stays within the
+ * range open-loop brightness uses, so a fault in the feedback can't
+ * drive the boost harder than before.  While the display is dark the
+ * boost is off, so there is nothing to regulate; the controller
+ * stops, and starts again from the brightness when it comes back.
+ */
+#define BOOST_INTERVAL	20	/* ms between samples */
+#define BOOST_KP	8	/* duty per ADC count, << BOOST_SHIFT */
+#define BOOST_SHIFT	6
+
+/* ADC counts per volt at the boost output, x16, with an AVcc reference */
+#define BOOST_COUNTS_X16 \
+  (1024UL * 16 * BOOST_R2 / (BOOST_R1 + BOOST_R2) / 5)
+
+static volatile uint16_t boost_target;	/* ADC counts */
+static int16_t boost_integ;		/* duty << BOOST_SHIFT */
+static uint16_t boost_due;
+
+/* One step of the PI controller; from the ADC interrupt */
+static void boost_feedback(uint16_t x)
+{
+  int16_t err = boost_target - x;
+  int16_t out;
+
+  if (dark)
+    return;			/* a sample started just before */
+
+  out = (boost_integ + err * BOOST_KP) >> BOOST_SHIFT;
+
+  /* don't wind up the integral against the limits */
+  if (out < BRITE_MIN)
+    out = BRITE_MIN;
+  else if (out > BRITE_MAX)
+    out = BRITE_MAX;
+  else
+    boost_integ += err;
+
+  OCR0A = out;
+}
+
+SIGNAL(ADC_vect) {
+  uint16_t x = ADC;
+
+  if (BOOST_FEEDBACK && (ADMUX & 0x0f) == BOOST_ADC) {
+    boost_feedback(x);
+    return;
+  }
+
+  if ((ADMUX & 0x0f) == TEMP_ADC) {
+    temp_feed(temp_sim != TEMP_NOSIM ? temp_sim : temp_from_adc(x));
+    return;
+  }
+
+  if (light_sim != LIGHT_NOSIM)
+    x = light_sim;
+  light_feed(x);
+}
+
+/* Filtered light reading, 0 (dark) to 1023 */
+static uint16_t light_level(void)
+{
+  uint16_t l;
+
+  cli();
+  l = light_acc >> LIGHT_SHIFT;
+  sei();
+
+  return l;
+}
+
+/*
+ * How far from nightbrite to daybrite to go for a light reading, out
+ * of 255, at readings 0, 128, 256 ... 1024.  Set by eye with a GL5528
+ * LDR: the eye is most sensitive to changes in the dark, so most of
+ * the range goes in the bottom third.
+ */
+static const uint8_t light_curve[] PROGMEM = {
+  0, 64, 112, 152, 184, 208, 228, 244, 255
+};
+
+static uint8_t light_brite(uint16_t light)
+{
+  uint8_t i = light >> 7;
+  uint8_t lo = pgm_read_byte(&light_curve[i]);
+  uint8_t hi = pgm_read_byte(&light_curve[i + 1]);
+  uint8_t f = lo + ((hi - lo) * (light & 127) >> 7);
+
+  return nightbrite + (int16_t)(daybrite - nightbrite) * f / 255;
+}
+
+static uint8_t get_brite(void)
+{
+  uint32_t now = clock_now();
+  uint8_t b;
+
+  if (alarming)
+    b = (now % 2) ? BRITE_MIN : BRITE_MAX;
+  else if (autobrite)
+    b = light_brite(light_level());
+  else {
+    uint8_t hour = now % 86400 / 3600;
+
+    b = nightbrite;
+    if (hour >= morning && hour < evening)
+      b = daybrite;
+  }
+
+  /* safety */
+  if (b < BRITE_MIN || b > BRITE_MAX)
+    b = BRITE_MIN;
+
+  return b;
+}
+
+/* Show brightness b: directly as the boost duty, or as a target voltage */
+static void apply_brite(uint8_t b)
+{
+  uint16_t volts;
+
+  if (!BOOST_FEEDBACK) {
+    OCR0A = b;
+    return;
+  }
+
+  volts = BOOST_VMIN + (b - BRITE_MIN) * (BOOST_VMAX - BOOST_VMIN) /
+    (BRITE_MAX - BRITE_MIN);
+
+  cli();
+  /* start from the open-loop duty cycle the first time */
+  if (!boost_target)
+    boost_integ = b << BOOST_SHIFT;
+  boost_target = volts * BOOST_COUNTS_X16 / 16;
+  sei();
+}
+
+static void set_brite(void)
+{
+  apply_brite(get_brite());
+}
+
+/* Regulate the boost afresh, from the open-loop duty cycle */
+static void boost_restart(void)
+{
+  uint8_t b;
+
+  if (!BOOST_FEEDBACK)
+    return;
+
+  b = get_brite();
+  cli();
+  boost_target = 0;		/* so apply_brite() starts over */
+  OCR0A = b;
+  sei();
+  apply_brite(b);
+}
+
+static void adc_start(uint8_t chan)
+{
+  ADMUX = _BV(REFS0) | chan;		/* AVcc reference */
+  DIDR0 |= _BV(chan);
+  /* 8MHz / 64 = 125kHz ADC clock */
+  ADCSRA = _BV(ADEN) | _BV(ADSC) | _BV(ADIE) | _BV(ADPS2) | _BV(ADPS1);
+}
+
+/*
+ * Start whichever ADC reading is due, the boost feedback first; from
+ * the main loop, just before it sleeps.
+ */
+static void adc_service(void)
+{
+  uint16_t t = now();
+
+  if (ADCSRA & _BV(ADSC))
+    return;			/* still converting */
+
+  if (BOOST_FEEDBACK && !dark && (int16_t)(t - boost_due) >= 0) {
+    boost_due = t + BOOST_INTERVAL;
+    adc_start(BOOST_ADC);
+  } else if (autobrite && (int16_t)(t - light_due) >= 0) {
+    light_due = t + LIGHT_INTERVAL;
+    adc_start(LIGHT_ADC);
+    set_brite();		/* follow the last reading */
+  } else if (tempcomp && (int16_t)(t - temp_due) >= 0) {
+    temp_due = t + TEMP_INTERVAL;
+    adc_start(TEMP_ADC);
+  }
+}
+
+/* Recalculate the deadlines after the time, date or alarm changes */
+static void clock_resync(void)
+{
+  uint32_t now = clock_now();
+
+  clock_last = now;
+  hour_next = (now / 3600 + 1) * 3600;
+  dst_update(now);
+  alarm_update(now);
+  dark_update(now);
+
+  set_brite();
 }
 
-static uint8_t get_brite(void)
+/* Called when clock_secs reaches dst_next */
+static void dst_apply(void)
 {
-  uint8_t b;
-
-  if (alarming)
-    b = (timedate.time.s % 2) ? BRITE_MIN : BRITE_MAX;
-  else {
-    uint8_t hour = timedate.time.h;
+  uint32_t at = dst_next;
+  uint32_t now;
 
-    b = nightbrite;
-    if (hour >= morning && hour < evening)
-      b = daybrite;
-  }
+  cli();
+  clock_secs += dst_shift * 3600L;
+  now = clock_secs;
+  sei();
+  learn_shift(dst_shift * 3600L);
 
-  /* safety */
-  if (b < BRITE_MIN || b > BRITE_MAX)
-    b = BRITE_MIN;
+  clock_last = now;
+  hour_next = (now / 3600 + 1) * 3600;
 
-  return b;
-}
+  timedate_sync();
+  eeprom_write_byte((uint8_t *)EE_HOUR, timedate.time.h);
 
-static void set_brite(void)
-{
-  OCR0A = get_brite();
+  /* after falling back, the same time comes round again; skip it */
+  dst_update(at);
 }
 
 /*
  * This goes off once a second, driven by the external 32.768kHz
- * crystal.  It leaves interrupts disabled so it can never itself be
- * interrupted.
+ * crystal.  It only counts the second and loads the compare value for
+ * the next one; clock_update() does everything else from the main
+ * loop, so this stays short and bounds latency for the other
+ * interrupts.
  */
 SIGNAL (TIMER2_COMPA_vect) {
-  struct timedate td;
-
   // write to unused timer2 register:  the sleep code will ensure this value
   // gets written before going to sleep--something that requires one full
   // quartz crystal clock cycle.  This is important because this interrupt
@@ -787,57 +1952,91 @@ SIGNAL (TIMER2_COMPA_vect) {
     CLKPR = 0;
   }
 
-  td = timedate;
+  // drift correction, if clock_update() scheduled one, lasts one second
+  OCR2A = rtc_ocr;
+  rtc_ocr = DRIFT_BASELINE;
+
+  clock_secs++;
+}
 
-  if (!suspend_update) {
-    increment_time(&td);
+/*
+ * Act on the seconds counted by the RTC interrupt.  Everything due at
+ * a set time is a deadline in clock_secs, so unless one has come this
+ * is a couple of comparisons.  Called from the main loop and the menu
+ * loops; if it runs late, deadlines are still met, just late.
+ */
+static void clock_update(void)
+{
+  uint32_t now = clock_now();
+  uint32_t elapsed = now - clock_last;
 
-    /* Apply drift correction on the first second of each hour */
-    if (td.time.m == 0) {
-      if (td.time.s == 0)
-	OCR2A = DRIFT_BASELINE + drift;
-      else if (td.time.s == 1)
-	OCR2A = DRIFT_BASELINE;
+  /*
+   * Alarm switched off: silence it here rather than in the interrupt,
+   * so it happens in the menus too.  Turning it on waits for ui().
+   */
+  if (alarm_switched && !button_poll(BUT_ALARM))
+    setalarmstate();
 
-      if (td.time.s <= 1) {
-	/* wait for update to take effect */
-	while (ASSR & _BV(OCR2AUB))
-	  ;
-      }
-    }
+  if (!elapsed)
+    return;
+  clock_last = now;
 
-    timedate = td;
+  if (snoozetimer)
+    snoozetimer = elapsed < snoozetimer ? snoozetimer - elapsed : 0;
+
+  /*
+   * Apply drift correction to the first second of each hour, less
+   * any temperature correction; the RTC interrupt loads it at the
+   * start of that second.
+   */
+  if (!drift_pending && now + 1 >= hour_next) {
+    rtc_ocr = DRIFT_BASELINE + drift - temp_ticks();
+    drift_pending = 1;
   }
 
-  // If we're in low power mode we should get out now since the display is off
-  if (sleepmode)
-    return;
-   
-  if (alarm_on && (alarm_days & (1 << dotw(&td.date))) &&
-      (alarm.h == td.time.h) &&
-      (alarm.m == td.time.m) && (td.time.s == 0)) {
-    DEBUGP("alarm on!");
-    alarming = 1;
-    snoozetimer = 0;
+  if (now >= hour_next) {
+    hour_next = (now / 3600 + 1) * 3600;
+    drift_pending = 0;
+
+    timedate_sync();
+    save_hourly(now);
+
+    /* refresh the next DST change once a day, in case the rules moved on */
+    if (now % 86400 < 3600)
+      dst_update(now);
+
+    /* brightness and dark hours go by the hour */
+    set_brite();
+    dark_update(now);
   }
 
-  /* set brightness according to alarm state and time */
-  set_brite();
+  if (now >= dst_next)
+    dst_apply();
 
-  if (snoozetimer)
-    snoozetimer--;
+  if (now >= alarm_next) {
+    // not in low power mode, since the display is off
+    if (alarm_on && !sleepmode) {
+      DEBUGP("alarm on!");
+      alarming = 1;
+      snoozetimer = 0;
+    }
+    alarm_update(now);
+  }
+
+  /* flash while the alarm is going off, and sound it unless snoozing */
+  if (alarming)
+    set_brite();
+  alarm_sound(alarming && !snoozetimer);
+
+  /* dark hours turn the display off, but not while the alarm goes */
+  if (!sleepmode)
+    display_dark(dark_window && !alarming && now >= dark_until);
 }
 
 //Alarm Switch
 SIGNAL(INT0_vect) {  
-  uint8_t state;
-
-  state = (ALARM_PIN & _BV(ALARM));
-  button_change_intr(BUT_ALARM, state);
-
-  /* Turn off alarm immediately */
-  if (!state)
-    setalarmstate();
+  /* alarm is turned off once the switch has settled */
+  button_change_intr(BUT_ALARM, button_pin(BUT_ALARM));
 }
 
 
@@ -850,10 +2049,8 @@ SIGNAL(ANALOG_COMP_vect) {
       VFDCLK_PORT &= ~_BV(VFDCLK) & ~_BV(VFDDATA); // no power to vfdchip
       BOOST_PORT &= ~_BV(BOOST); // pull boost fet low
       SPCR  &= ~_BV(SPE); // turn off spi
-      if (restored) {
-	eeprom_write_byte((uint8_t *)EE_MIN, timedate.time.m);
-	eeprom_write_byte((uint8_t *)EE_SEC, timedate.time.s);
-      }
+      if (restored)
+	save_minsec();
       DEBUGP("z");
       TCCR0B = 0; // no boost
       volume = 0; // low power buzzer
@@ -864,10 +2061,8 @@ SIGNAL(ANALOG_COMP_vect) {
   } else {
     //DEBUGP("LOW");
     if (sleepmode) {
-      if (restored) {
-	eeprom_write_byte((uint8_t *)EE_MIN, timedate.time.m);
-	eeprom_write_byte((uint8_t *)EE_SEC, timedate.time.s);
-      }
+      if (restored)
+	save_minsec();
       DEBUGP("WAKERESET"); 
       app_start();
     }
@@ -896,21 +2091,92 @@ static void emit_number_slz(uint8_t *disp, uint8_t num)
   __emit_number(disp, num, EMIT_SLZ);
 }
 
+/*
+ * The time face as a render plan: one byte per item, the operation in
+ * the top nibble and the display position in the bottom.  It depends
+ * only on region and secondmode, so time_plan_build() redoes it when
+ * they change, and drawing the time each second just runs through it.
+ */
+#define PLAN(op, pos)	((op) << 4 | (pos))
+
+#define PLAN_END	0
+#define PLAN_HOUR24	1	/* 00-23 */
+#define PLAN_HOUR12	2	/* 1-12, and the pm dot */
+#define PLAN_MIN	3
+#define PLAN_SEC	4
+#define PLAN_SEP	5	/* dash on odd seconds */
+#define PLAN_DIAL	6	/* the seconds as a dial */
+#define PLAN_AMPM	7
+
+/* for the defaults, REGION_US and SEC_FULL, until EEPROM is read */
+static uint8_t time_plan[5] = {
+  PLAN(PLAN_HOUR12, 1), PLAN(PLAN_SEP, 3), PLAN(PLAN_MIN, 4),
+  PLAN(PLAN_SEC, 7), PLAN_END
+};
+
+static void time_plan_build(void)
+{
+  uint8_t *p = time_plan;
+
+  if (region == REGION_US)
+    *p++ = PLAN(PLAN_HOUR12, 1);
+  else
+    *p++ = PLAN(PLAN_HOUR24, 1);
+  if (secondmode != SEC_DIAL)
+    *p++ = PLAN(PLAN_SEP, 3);
+  *p++ = PLAN(PLAN_MIN, 4);
+
+  switch (secondmode) {
+  default:
+  case SEC_FULL:
+    *p++ = PLAN(PLAN_SEC, 7);
+    break;
+
+  case SEC_DIAL:
+    *p++ = PLAN(PLAN_DIAL, 7);
+    break;
+
+  case SEC_AMPM:
+    if (region == REGION_US)
+      *p++ = PLAN(PLAN_AMPM, 7);
+    break;
+
+  case SEC_NONE:
+    break;
+  }
+
+  *p = PLAN_END;
+}
+
+typedef unsigned char (field_display_t)(unsigned char pos,
+					const unsigned char *val);
+typedef void (field_update_t)(unsigned char *val, uint8_t step);
+
 struct field {
-  unsigned char (*display)(unsigned char pos, const unsigned char *val);
-  void (*update)(unsigned char *val);
+  field_display_t *display;
+  field_update_t *update;
   union {
     const unsigned char *str;
     unsigned char *val;
   };
 };
 
+/* Field tables live in PROGMEM; these fetch members in place */
+#define FIELD_DISPLAY(f)	((field_display_t *)pgm_read_word(&(f)->display))
+#define FIELD_UPDATE(f)		((field_update_t *)pgm_read_word(&(f)->update))
+#define FIELD_VAL(f)		((unsigned char *)pgm_read_word(&(f)->val))
+
 struct entry {
-  const char *prompt;
+  const char *prompt;		/* PROGMEM too */
   void (*get)(void);
   void (*store)(void);
 };
 
+/* Menu tables live in PROGMEM too */
+#define ENTRY_PROMPT(e)		((const char *)pgm_read_word(&(e)->prompt))
+#define ENTRY_GET(e)		((void (*)(void))pgm_read_word(&(e)->get))
+#define ENTRY_STORE(e)		((void (*)(void))pgm_read_word(&(e)->store))
+
 static const unsigned char space_P[] PROGMEM = " ";
 static const unsigned char dash_P[] PROGMEM = "-";
 
@@ -943,10 +2209,7 @@ static unsigned char show_hour(unsigned char pos, const unsigned char *v)
 
 static unsigned char show_str(unsigned char pos, const unsigned char *v)
 {
-  char str[DISPLAYSIZE + 1];
-
-  strcpy_P(str, (const char *)v);
-  return __display_str(display+pos, str);
+  return __display_str_P(display+pos, (const char *)v);
 }
 
 static unsigned char show_ampm(unsigned char pos, const unsigned char *v)
@@ -960,41 +2223,6 @@ static unsigned char show_ampm(unsigned char pos, const unsigned char *v)
     return show_str(pos, (const unsigned char *)PSTR("am"));
 }
 
-static uint8_t show_separator(uint8_t pos, const uint8_t *v)
-{
-  const unsigned char *str = space_P;
-
-  if (secondmode != SEC_DIAL && (*v & 1))
-    str = dash_P;
-
-  return show_str(pos, str);
-}
-
-static unsigned char show_second(unsigned char pos, const unsigned char *v)
-{
-  struct time *t = (struct time *)v;
-  unsigned char s = t->s;
-
-  switch (secondmode) {
-  default:
-  case SEC_FULL:
-    emit_number(display+pos, s);
-    return 2;
-
-  case SEC_DIAL:
-    display[pos] = (0x80 >> (s / 10)) | ((~s & 1) << 1);
-    return 1;
-
-  case SEC_AMPM:
-    if (region == REGION_US)
-      return show_ampm(pos, &t->h);
-    /* FALLTHROUGH */
-
-  case SEC_NONE:
-    return 0;
-  }
-}
-
 static unsigned char show_days(unsigned char pos, const unsigned char *v)
 {
   static const char *str;
@@ -1004,16 +2232,18 @@ static unsigned char show_days(unsigned char pos, const unsigned char *v)
   case DAYS_ALL:	str = PSTR("all "); break;
   case DAYS_WEEKEND:	str = PSTR("wknd"); break;
   case DAYS_WEEK:	str = PSTR("week"); break;
+  case DAYS_NONE:	str = PSTR("no  "); break;
   }
 
   return show_str(pos, (unsigned char *)str);
 }
 
-static void update_days(unsigned char *v)
+static void update_days(unsigned char *v, uint8_t step)
 {
   switch (*v) {
   default:
-  case DAYS_WEEKEND:	*v = DAYS_ALL; break;
+  case DAYS_NONE:	*v = DAYS_ALL; break;
+  case DAYS_WEEKEND:	*v = DAYS_NONE; break;
   case DAYS_WEEK:	*v = DAYS_WEEKEND; break;
   case DAYS_ALL:	*v = DAYS_WEEK; break;
   }
@@ -1025,101 +2255,87 @@ static const char *dayofweek(const struct date *date)
   DOW(sunday);
   DOW(monday);
   DOW(tuesday);
-  DOW(wednsday);
+  DOW(wednesday);
   DOW(thursday);
   DOW(friday);
   DOW(saturday);
 #undef DOW
   static const char *days[] = {
-    sunday, monday, tuesday, wednsday, thursday, friday, saturday
+    sunday, monday, tuesday, wednesday, thursday, friday, saturday
   };
 
   return days[dotw(date)];
 }
 
-static unsigned char show_dayofweek(unsigned char pos, const unsigned char *v)
-{
-  const struct date *date = (const struct date *)v;
-
-  return show_str(pos, (unsigned char *)dayofweek(date));
-}
-
 static const char *monthname(uint8_t month)
 {
 #define MON(m)	static const char m[] PROGMEM = #m
-  MON(jan);
-  MON(feb);
+  MON(january);
+  MON(february);
   MON(march);
   MON(april);
   MON(may);
   MON(june);
   MON(july);
-  MON(augst);
-  MON(sept);
-  MON(octob);
-  MON(novem);
-  MON(decem);
+  MON(august);
+  MON(september);
+  MON(october);
+  MON(november);
+  MON(december);
 #undef MON
   static const char *months[] = {
-    jan, feb, march, april, may, june,
-    july, augst, sept, octob, novem, decem
+    january, february, march, april, may, june,
+    july, august, september, october, november, december
   };
 
   return months[month-1];
 }
 
-static unsigned char show_monthname(unsigned char pos, const unsigned char *v)
-{
-  return show_str(pos, (unsigned char *)monthname(*v));
-}
   
-static void update_hour(unsigned char *v)
+static void update_hour(unsigned char *v, uint8_t step)
 {
-  if (++*v >= 24)
-    *v = 0;
+  *v = (*v + step) % 24;
 }
 
-static void update_mod60(unsigned char *v)
+static void update_mod60(unsigned char *v, uint8_t step)
 {
-  if (++*v >= 60)
-    *v = 0;
+  *v = (*v + step) % 60;
 }
 
-static void update_mod60_s5(unsigned char *v)
+static void update_mod60_s5(unsigned char *v, uint8_t step)
 {
-  if ((*v += 5) >= 60)
-    *v = 0;
+  *v = (*v + 5 * step) % 60;
 }
 
-static void update_day(unsigned char *v)
+static void update_day(unsigned char *v, uint8_t step)
 {
-  if (++*v > 31)
-    *v = 1;
+  *v = (*v - 1 + step) % 31 + 1;
 }
 
-static void update_month(unsigned char *v)
+static void update_month(unsigned char *v, uint8_t step)
 {
-  if (++*v > 12)
-    *v = 1;
+  *v = (*v - 1 + step) % 12 + 1;
 }
 
-static void update_year(unsigned char *v)
+/* Fields with a hundred or more values go twice as fast once repeating */
+#define WIDE_STEP(step)	((step) > 1 ? 2 * (step) : (step))
+
+static void update_year(unsigned char *v, uint8_t step)
 {
-  if (++*v > 99)
-    *v = 0;
+  *v = (*v + WIDE_STEP(step)) % 100;
 }
 
-static void update_brite(unsigned char *v)
+static void update_brite(unsigned char *v, uint8_t step)
 {
   unsigned char new = *v;
 
-  new += BRITE_STEP;
+  new += BRITE_STEP * step;
   if (new < BRITE_MIN)
     new = BRITE_MIN;
   if (new > BRITE_MAX)
     new = BRITE_MIN;
 
-  OCR0A = new;
+  apply_brite(new);
 
   *v = new;
 }
@@ -1132,16 +2348,16 @@ static unsigned char show_vol(unsigned char pos, const unsigned char *v)
     return show_str(pos, (unsigned char *)PSTR("low"));
 }
 
-static void update_toggle(unsigned char *v)
+static void update_toggle(unsigned char *v, uint8_t step)
 {
   *v = !*v;
 }  
 
-static void update_vol(unsigned char *v)
+static void update_vol(unsigned char *v, uint8_t step)
 {
   *v = !*v;
   speaker_init();
-  beep(4000, 1);
+  beep(BEEP_ONE);
 }
 
 static unsigned char show_region(unsigned char pos, const unsigned char *v)
@@ -1168,26 +2384,32 @@ static unsigned char show_secmode(unsigned char pos, const unsigned char *v)
   return show_str(pos, (unsigned char *)ret);
 }
 
-static void update_secmode(unsigned char *v)
+static void update_secmode(unsigned char *v, uint8_t step)
 {
   if (++*v > SEC_NONE)
     *v = 0;
 }
 
 static struct menu_state {
-  union {
-    struct time time;
-    struct date date;
-    unsigned char val;
-  };
-
+  const struct field *fields;	/* in PROGMEM */
   unsigned char nfields;
-  struct field fields[5];
 } menu_state;
 
 #define SPACE	  { show_str, NULL, .str = space_P }
 #define DASH	  { show_str, NULL, .str = dash_P }
 
+static void update_alarmnum(unsigned char *v, uint8_t step)
+{
+  *v = *v % NALARMS + 1;
+}
+
+static const unsigned char alarm_P[] PROGMEM = "alarm";
+static const struct field alarmnum_fields[] PROGMEM = {
+  { show_str, NULL, .str = alarm_P },
+  SPACE,
+  { show_num_slz, update_alarmnum, .val = &alarm_num },
+};
+
 static const struct field alarm_fields[] PROGMEM = {
   { show_hour, update_hour, .val = &alarm.h },
   DASH,
@@ -1202,14 +2424,6 @@ static const struct field alarmdays_fields[] PROGMEM = {
   { show_str, NULL, .str = days_P },
 };
 
-static const struct field time_fields[] PROGMEM = {
-  { show_hour, update_hour, .val = &timedate.time.h },
-  { show_separator, NULL, .val = &timedate.time.s },
-  { show_num, update_mod60, .val = &timedate.time.m },
-  SPACE,
-  { show_second, NULL, .val = (unsigned char *)&timedate.time },
-};
-
 static const struct field timeset_fields[] PROGMEM = {
   { show_hour, update_hour, .val = &timedate.time.h },
   SPACE,
@@ -1234,20 +2448,9 @@ static const struct field euro_date_fields[] PROGMEM = {
   { show_num, update_year, .val = &timedate.date.y },
 };
 
-static const struct field dotw_fields[] PROGMEM = {
-  { show_dayofweek, NULL, .val = (unsigned char *)&timedate.date },
-};
-
-static const struct field monthdate_fields[] PROGMEM = {
-  { show_monthname, NULL, .str = &timedate.date.m },
-  SPACE,
-  { show_num_slz, NULL, .str = &timedate.date.d },
-};
-
-static void update_morning(unsigned char *v)
+static void update_morning(unsigned char *v, uint8_t step)
 {
-  if (++*v >= 12)
-    *v = 0;
+  *v = (*v + step) % 12;
 }
 
 static const unsigned char day_P[] PROGMEM = "dy ";
@@ -1258,10 +2461,9 @@ static const struct field day_fields[] PROGMEM = {
   { show_num, update_brite, .val = &daybrite },
 };
 
-static void update_evening(unsigned char *v)
+static void update_evening(unsigned char *v, uint8_t step)
 {
-  if (++*v >= 24)
-    *v = 12;
+  *v = (*v - 12 + step) % 12 + 12;
 }
 
 static const unsigned char night_P[] PROGMEM = "nt ";
@@ -1272,6 +2474,53 @@ static const struct field night_fields[] PROGMEM = {
   { show_num, update_brite, .val = &nightbrite },
 };
 
+static unsigned char show_onoff(unsigned char pos, const unsigned char *v)
+{
+  if (*v)
+    return show_str(pos, (unsigned char *)PSTR("on"));
+  else
+    return show_str(pos, (unsigned char *)PSTR("off"));
+}
+
+/*
+ * Dark hours show two hours at once, so in 12-hour regions each gets
+ * its own a or p rather than sharing show_hour()'s pm notice.  That
+ * leaves no room for the label.
+ */
+static unsigned char show_hour_ap(unsigned char pos, const unsigned char *v)
+{
+  uint8_t h = *v;
+
+  if (region != REGION_US)
+    return show_hour(pos, v);
+
+  display[0] &= ~0x1;		/* no shared pm notice */
+  emit_number_slz(display+pos, ((h+11) % 12) + 1);
+  if (h >= 12)
+    return 2 + show_str(pos + 2, (const unsigned char *)PSTR("p"));
+  else
+    return 2 + show_str(pos + 2, (const unsigned char *)PSTR("a"));
+}
+
+static unsigned char show_label24(unsigned char pos, const unsigned char *v)
+{
+  return region == REGION_US ? 0 : show_str(pos, v);
+}
+
+static const unsigned char dark_P[] PROGMEM = "of ";
+static const struct field dark_fields[] PROGMEM = {
+  { show_label24, NULL, .str = dark_P },
+  { show_hour_ap, update_hour, .val = &dark_start },
+  DASH,
+  { show_hour_ap, update_hour, .val = &dark_end },
+};
+
+static const unsigned char auto_P[] PROGMEM = "auto ";
+static const struct field auto_fields[] PROGMEM = {
+  { show_str, NULL, .str = auto_P },
+  { show_onoff, update_toggle, .val = &autobrite },
+};
+
 static const unsigned char vol_P[] PROGMEM = "vol ";
 static const struct field vol_fields[] PROGMEM = {
   { show_str, NULL, .str = vol_P },
@@ -1282,6 +2531,31 @@ static const struct field region_fields[] PROGMEM = {
   { show_region, update_toggle, .val = &region },
 };
 
+static unsigned char show_dst(unsigned char pos, const unsigned char *v)
+{
+  const char *ret;
+
+  switch (*v) {
+  default:
+  case DST_OFF:	ret = PSTR("off"); break;
+  case DST_US:	ret = PSTR("usa"); break;
+  case DST_EU:	ret = PSTR("eur"); break;
+  }
+  return show_str(pos, (unsigned char *)ret);
+}
+
+static void update_dst(unsigned char *v, uint8_t step)
+{
+  if (++*v > DST_EU)
+    *v = DST_OFF;
+}
+
+static const unsigned char dst_P[] PROGMEM = "dst ";
+static const struct field dst_fields[] PROGMEM = {
+  { show_str, NULL, .str = dst_P },
+  { show_dst, update_dst, .val = &dst_mode },
+};
+
 static const unsigned char sec_P[] PROGMEM = "sec ";
 static const struct field secmode_fields[] PROGMEM = {
   { show_str, NULL, .str = sec_P },
@@ -1306,12 +2580,13 @@ static uint8_t show_drift(uint8_t pos, const unsigned char *v)
   return 3;
 }
 
-static void update_drift(unsigned char *v)
+static void update_drift(unsigned char *v, uint8_t step)
 {
   int8_t d = *v;
 
-  if (++d > DRIFT_MAX)
-    d = DRIFT_MIN;
+  d += WIDE_STEP(step);
+  if (d > DRIFT_MAX)
+    d += DRIFT_MIN - DRIFT_MAX - 1;
 
   *v = d;
 }
@@ -1322,84 +2597,176 @@ static const struct field drift_fields[] PROGMEM = {
   { show_drift, update_drift, .val = (unsigned char *)&drift },
 };
 
-static void copy_fields(const struct field *fields, unsigned int nelem)
+static const unsigned char tcmp_P[] PROGMEM = "tcmp ";
+static const struct field tempcomp_fields[] PROGMEM = {
+  { show_str, NULL, .str = tcmp_P },
+  { show_onoff, update_toggle, .val = &tempcomp },
+};
+
+static void use_fields(const struct field *fields, unsigned int nelem)
 {
-  memcpy_P(menu_state.fields, fields, nelem * sizeof(struct field));
+  menu_state.fields = fields;
   menu_state.nfields = nelem;
 }
 
+/* EEPROM address of alarm n's hour; its minute and days follow */
+static uint8_t *alarm_ee(uint8_t n)
+{
+  return (uint8_t *)(n ? EE_ALARMS + 3 * (n - 1) : EE_ALARM_HOUR);
+}
+
+/* Make alarm number 'num' the one shown and set */
+static void alarm_select(uint8_t num)
+{
+  alarm_num = num;
+  alarm = alarms[num - 1];
+  alarm_days = alarms_days[num - 1];
+}
+
+static void get_alarmnum(void)
+{
+  use_fields(alarmnum_fields, NELEM(alarmnum_fields));
+}
+
+static void store_alarmnum(void)
+{
+  alarm_select(alarm_num);
+}
+
 static void get_alarm(void)
 {
-  copy_fields(alarm_fields, NELEM(alarm_fields));
+  alarm_select(alarm_num);
+  use_fields(alarm_fields, NELEM(alarm_fields));
 }
 
 static void store_alarm(void)
 {
-  eeprom_write_byte((uint8_t *)EE_ALARM_HOUR, alarm.h);
-  eeprom_write_byte((uint8_t *)EE_ALARM_MIN, alarm.m);
-  eeprom_write_byte((uint8_t *)EE_ALARM_DAYS, alarm_days);
+  uint8_t n = alarm_num - 1;
+  uint8_t *ee = alarm_ee(n);
+
+  alarms[n] = alarm;
+  alarms_days[n] = alarm_days;
+
+  eeprom_write_byte(ee, alarm.h);
+  eeprom_write_byte(ee + 1, alarm.m);
+  eeprom_write_byte(ee + 2, alarm_days);
+
+  alarm_update(clock_now());
 }
 
 static void get_alarmdays(void)
 {
-  copy_fields(alarmdays_fields, NELEM(alarmdays_fields));
+  alarm_select(alarm_num);
+  use_fields(alarmdays_fields, NELEM(alarmdays_fields));
 }
 
 static void get_time(void)
 {
+  timedate_sync();
   suspend_update = 1;
-  copy_fields(timeset_fields, NELEM(timeset_fields));
+  use_fields(timeset_fields, NELEM(timeset_fields));
   barrier();
 }
 
 static void store_time(void)
 {
+  uint32_t t = timedate_secs(&timedate);
+
+  /*
+   * Left as it was shown: that isn't a correction, and the clock went
+   * on while the menu was open, so just catch timedate up with it.
+   */
   timeunknown = 0;
+  if (t == timedate_at) {
+    suspend_update = 0;
+    timedate_sync();
+    return;
+  }
+  drift_learn((int32_t)(t - clock_now()) * 128 - TCNT2, t);
 
   eeprom_write_byte((uint8_t *)EE_HOUR, timedate.time.h);
   eeprom_write_byte((uint8_t *)EE_MIN, timedate.time.m);
 
+  cli();
   TCNT2 = 0;
+  sei();
+  clock_set_secs(t);
   suspend_update = 0;
 
-  set_brite();
+  clock_resync();
 }
 
-static void get_date(void)
+static void use_date_fields(void)
 {
   if (region == REGION_US) {
-    copy_fields(us_date_fields, NELEM(us_date_fields));
+    use_fields(us_date_fields, NELEM(us_date_fields));
   } else {
-    copy_fields(euro_date_fields, NELEM(euro_date_fields));
+    use_fields(euro_date_fields, NELEM(euro_date_fields));
   }
 }
 
+static void get_date(void)
+{
+  timedate_sync();
+  suspend_update = 1;
+  use_date_fields();
+}
+
 static void store_date(void)
 {
+  uint16_t day = daynum(timedate.date.y, timedate.date.m, timedate.date.d);
+  uint32_t now = clock_now();
+  uint32_t t = day * 86400UL + now % 86400;
+
+  /* left as shown; midnight may have passed since, so don't go back */
+  if (day == timedate_at / 86400) {
+    suspend_update = 0;
+    timedate_sync();
+    return;
+  }
+
+  /* the time carried on while the date was edited */
+  clock_set_secs(t);
+  learn_shift(t - now);
+  suspend_update = 0;
+
   eeprom_write_byte((uint8_t *)EE_DAY, timedate.date.d);    
   eeprom_write_byte((uint8_t *)EE_MONTH, timedate.date.m);    
   eeprom_write_byte((uint8_t *)EE_YEAR, timedate.date.y);    
+
+  clock_resync();
 }
 
 static void get_day(void)
 {
-  copy_fields(day_fields, NELEM(day_fields));
+  use_fields(day_fields, NELEM(day_fields));
 }
 
 static void get_night(void)
 {
-  copy_fields(night_fields, NELEM(night_fields));
+  use_fields(night_fields, NELEM(night_fields));
 }
 
 static void store_brite(void)
 {
   save_brite();
   set_brite();
+  dark_update(clock_now());
+}
+
+static void get_dark(void)
+{
+  use_fields(dark_fields, NELEM(dark_fields));
+}
+
+static void get_auto(void)
+{
+  use_fields(auto_fields, NELEM(auto_fields));
 }
 
 static void get_vol(void)
 {
-  copy_fields(vol_fields, NELEM(vol_fields));
+  use_fields(vol_fields, NELEM(vol_fields));
 }
 
 static void store_vol(void)
@@ -1409,27 +2776,40 @@ static void store_vol(void)
 
 static void get_region(void)
 {
-  copy_fields(region_fields, NELEM(region_fields));
+  use_fields(region_fields, NELEM(region_fields));
 }
 
 static void store_region(void)
 {
   eeprom_write_byte((uint8_t *)EE_REGION, region);
+  time_plan_build();
+}
+
+static void get_dst(void)
+{
+  use_fields(dst_fields, NELEM(dst_fields));
+}
+
+static void store_dst(void)
+{
+  eeprom_write_byte((uint8_t *)EE_DST, dst_mode);
+  dst_update(clock_now());
 }
 
 static void get_secmode(void)
 {
-  copy_fields(secmode_fields, NELEM(secmode_fields));
+  use_fields(secmode_fields, NELEM(secmode_fields));
 }
 
 static void store_secmode(void)
 {
   eeprom_write_byte((uint8_t *)EE_SECONDMODE, secondmode);
+  time_plan_build();
 }
 
 static void get_snooze(void)
 {
-  copy_fields(snooze_fields, NELEM(snooze_fields));
+  use_fields(snooze_fields, NELEM(snooze_fields));
 }
 
 static void store_snooze(void)
@@ -1439,26 +2819,54 @@ static void store_snooze(void)
 
 static void get_drift(void)
 {
-  copy_fields(drift_fields, NELEM(drift_fields));
+  use_fields(drift_fields, NELEM(drift_fields));
 }
 
 static void store_drift(void)
 {
   eeprom_write_byte((uint8_t *)EE_DRIFT, drift);
+  eeprom_write_byte((uint8_t *)EE_TEMPCOMP, tempcomp);
+}
+
+static void get_tempcomp(void)
+{
+  use_fields(tempcomp_fields, NELEM(tempcomp_fields));
 }
 
+static const char prompt_alarmnum[] PROGMEM = "alarm number";
+static const char prompt_alarm[] PROGMEM = "set alarm";
+static const char prompt_alarmdays[] PROGMEM = "alarm days";
+static const char prompt_snooze[] PROGMEM = "set snooze";
+static const char prompt_time[] PROGMEM = "set time";
+static const char prompt_date[] PROGMEM = "set date";
+static const char prompt_day[] PROGMEM = "day brightness";
+static const char prompt_night[] PROGMEM = "night brightness";
+static const char prompt_auto[] PROGMEM = "auto brightness";
+static const char prompt_dark[] PROGMEM = "dark hours";
+static const char prompt_vol[] PROGMEM = "set vol";
+static const char prompt_region[] PROGMEM = "set region";
+static const char prompt_dst[] PROGMEM = "set dst";
+static const char prompt_secmode[] PROGMEM = "set seconds";
+static const char prompt_drift[] PROGMEM = "set drift";
+static const char prompt_tempcomp[] PROGMEM = "temp comp";
+
 static const struct entry mainmenu[] PROGMEM = {
-  { "set alarm", get_alarm, store_alarm },
-  { "alrm day", get_alarmdays, store_alarm },
-  { "set snoz", get_snooze, store_snooze },
-  { "set time", get_time, store_time },
-  { "set date", get_date, store_date },
-  { "day brite", get_day, store_brite },
-  { "nite brit", get_night, store_brite },
-  { "set vol", get_vol, store_vol },
-  { "set regn", get_region, store_region },
-  { "set secs", get_secmode, store_secmode },
-  { "set drft", get_drift, store_drift },
+  { prompt_alarmnum, get_alarmnum, store_alarmnum },
+  { prompt_alarm, get_alarm, store_alarm },
+  { prompt_alarmdays, get_alarmdays, store_alarm },
+  { prompt_snooze, get_snooze, store_snooze },
+  { prompt_time, get_time, store_time },
+  { prompt_date, get_date, store_date },
+  { prompt_day, get_day, store_brite },
+  { prompt_night, get_night, store_brite },
+  { prompt_auto, get_auto, store_brite },
+  { prompt_dark, get_dark, store_brite },
+  { prompt_vol, get_vol, store_vol },
+  { prompt_region, get_region, store_region },
+  { prompt_dst, get_dst, store_dst },
+  { prompt_secmode, get_secmode, store_secmode },
+  { prompt_drift, get_drift, store_drift },
+  { prompt_tempcomp, get_tempcomp, store_drift },
 };
 
 static void display_entry(char highlight, transition_t *trans)
@@ -1471,7 +2879,7 @@ static void display_entry(char highlight, transition_t *trans)
   for (i = 0; i < nfields; i++, field++) {
     uint8_t len;
     
-    len = field->display(pos, field->val);
+    len = FIELD_DISPLAY(field)(pos, FIELD_VAL(field));
 
     if (highlight == i) {
       uint8_t j;
@@ -1492,7 +2900,7 @@ static void display_entry(char highlight, transition_t *trans)
 static uint8_t skip_to_next_input(const struct field *field, unsigned char nfields,
 				  uint8_t next)
 {
-  while(next < nfields && field[next].update == NULL)
+  while(next < nfields && FIELD_UPDATE(&field[next]) == NULL)
     next++;
 
   return next;
@@ -1503,7 +2911,7 @@ static void show_entry(const struct entry *entry, transition_t *trans)
   const struct field *field;
   uint8_t input, nfields;
 
-  entry->get();
+  ENTRY_GET(entry)();
 
   nfields = menu_state.nfields;
   input = 0;
@@ -1512,7 +2920,7 @@ static void show_entry(const struct entry *entry, transition_t *trans)
     input = skip_to_next_input(menu_state.fields, nfields, input);
     if (input >= nfields)
       break;
-    field = &menu_state.fields[input];
+    field = &menu_state.fields[input];	/* PROGMEM */
 
     display_entry(input, trans);
 
@@ -1521,12 +2929,13 @@ static void show_entry(const struct entry *entry, transition_t *trans)
 
     for (;;) {
       kickthedog();
+      clock_update();
 
       if (button_timeout() || button_sample(BUT_MENU))
 	goto out;
 
       if (button_sample(BUT_NEXT)) {
-	field->update(field->val);
+	FIELD_UPDATE(field)(FIELD_VAL(field), button_step());
 	break;
       }
 
@@ -1540,27 +2949,48 @@ static void show_entry(const struct entry *entry, transition_t *trans)
   }
 
 out:
-  entry->store();
+  ENTRY_STORE(entry)();
+}
+
+/* Show the entry whose get function is 'get'; for menu shortcuts */
+static void show_entry_by_get(const struct entry *menu, int nentries,
+			      void (*get)(void))
+{
+  for (; nentries--; menu++) {
+    if (ENTRY_GET(menu) == get) {
+      show_entry(menu, scroll_up);
+      return;
+    }
+  }
 }
 
 static void show_menu(const struct entry *menu, int nentries)
 {
+  const struct entry *first = menu;
   uint8_t entry = 0;
   transition_t *trans = scroll_up;
+  struct button_event e;
 
-  while(entry < nentries) {
-    struct entry m;
+  /* anything from before the menu was opened is stale */
+  button_flush_events();
 
-    memcpy_P(&m, menu, sizeof(m));
-    display_str_trans(m.prompt, trans);
+  while(entry < nentries) {
+    display_str_trans_P(ENTRY_PROMPT(menu), trans);
     trans = scroll_left;
 
     for (;;) {
       kickthedog();
+      clock_update();
 
       if (button_timeout())
 	goto out;
 
+      /* holding MENU jumps straight to setting the time */
+      if (button_event(&e) && e.ev == BEVENT(BUT_MENU, BE_LONG)) {
+	show_entry_by_get(first, nentries, get_time);
+	goto out;
+      }
+
       if (button_sample(BUT_MENU)) {
 	entry++;
 	menu++;
@@ -1568,7 +2998,7 @@ static void show_menu(const struct entry *menu, int nentries)
       }
 
       if (button_sample(BUT_SET)) {
-	show_entry(&m, scroll_up);
+	show_entry(menu, scroll_up);
 	goto out;
       }
 
@@ -1582,8 +3012,54 @@ out:
 // This displays a time on the clock
 static void display_time(transition_t *trans)
 {
-  copy_fields(time_fields, NELEM(time_fields));
-  display_entry(-1, trans);
+  const uint8_t *p;
+  uint8_t h = timedate.time.h;
+  uint8_t s = timedate.time.s;
+
+  memset(display + 1, 0, DISPLAYSIZE - 1);
+
+  for (p = time_plan; *p != PLAN_END; p++) {
+    uint8_t *d = display + (*p & 0x0f);
+
+    switch (*p >> 4) {
+    case PLAN_HOUR24:
+      emit_number(d, h);
+      display[0] &= ~0x1;
+      break;
+
+    case PLAN_HOUR12:
+      emit_number_slz(d, ((h + 11) % 12) + 1);
+      if (h >= 12)
+	display[0] |= 0x1;	/* pm notice */
+      else
+	display[0] &= ~0x1;	/* am */
+      break;
+
+    case PLAN_MIN:
+      emit_number(d, timedate.time.m);
+      break;
+
+    case PLAN_SEC:
+      emit_number(d, s);
+      break;
+
+    case PLAN_SEP:
+      if (s & 1)
+	*d = glyph('-');
+      break;
+
+    case PLAN_DIAL:
+      *d = (0x80 >> (s / 10)) | ((~s & 1) << 1);
+      break;
+
+    case PLAN_AMPM:
+      d[0] = glyph(h >= 12 ? 'p' : 'a');
+      d[1] = glyph('m');
+      break;
+    }
+  }
+
+  flip_display(trans);
 }
 
 // Kinda like display_time but just hours and minutes
@@ -1596,18 +3072,24 @@ void display_alarm(transition_t *trans)
 // We can display the current date!
 static void display_date(uint8_t style)
 {
+  uint8_t n;
+
   switch (style) {
   case DATE:
-    get_date();
+    use_date_fields();
     display_entry(-1, scroll_up);
     break;
 
   case DAY:
-    copy_fields(dotw_fields, NELEM(dotw_fields));
-    display_entry(-1, scroll_up);
-    delayms(1000);
-    copy_fields(monthdate_fields, NELEM(monthdate_fields));
-    display_entry(-1, scroll_left);
+    display_str_trans_P(dayofweek(&timedate.date), scroll_up);
+    display_hold(1000);
+
+    /* then month and day, scrolling if they don't fit */
+    marquee_stop();
+    n = render_str(marquee, monthname(timedate.date.m), 1, MARQUEE_MAX - 3);
+    marquee[n++] = 0;
+    emit_number_slz(marquee + n, timedate.date.d);
+    display_marquee(n + 2, scroll_left);
     break;
   }
 }
@@ -1615,11 +3097,16 @@ static void display_date(uint8_t style)
 /**************************** RTC & ALARM *****************************/
 static void clock_init(void)
 {
+  uint8_t i;
+
   drift = eeprom_read_byte((uint8_t *)EE_DRIFT);
   if (drift > DRIFT_MAX || drift < DRIFT_MIN) {
     drift = 0;
     eeprom_write_byte((uint8_t *)EE_DRIFT, drift);
   }
+  tempcomp = eeprom_read_byte((uint8_t *)EE_TEMPCOMP) == 1;
+  learn_from = eeprom_read_dword((uint32_t *)EE_LEARNFROM);
+  learn_err = eeprom_read_dword((uint32_t *)EE_LEARNERR);
 
   // we store the time in EEPROM when switching from power modes so its
   // reasonable to start with whats in memory
@@ -1635,14 +3122,32 @@ static void clock_init(void)
   time_s = TIMESEC + 10;
   */
 
-  // Set up the stored alarm time and date
-  alarm.m = eeprom_read_byte((uint8_t *)EE_ALARM_MIN) % 60;
-  alarm.h = eeprom_read_byte((uint8_t *)EE_ALARM_HOUR) % 24;
-  alarm_days = eeprom_read_byte((uint8_t *)EE_ALARM_DAYS);
+  // Set up the stored alarms and date
+  for (i = 0; i < NALARMS; i++) {
+    uint8_t *ee = alarm_ee(i);
+
+    alarms[i].h = eeprom_read_byte(ee) % 24;
+    alarms[i].m = eeprom_read_byte(ee + 1) % 60;
+    alarms_days[i] = eeprom_read_byte(ee + 2);
+
+    /* the extra alarms start out unused on a fresh EEPROM */
+    if (i && (alarms_days[i] & ~DAYS_ALL))
+      alarms_days[i] = DAYS_NONE;
+  }
+  alarm_select(1);
 
   timedate.date.y = eeprom_read_byte((uint8_t *)EE_YEAR) % 100;
   timedate.date.m = eeprom_read_byte((uint8_t *)EE_MONTH) % 13;
   timedate.date.d = eeprom_read_byte((uint8_t *)EE_DAY) % 32;
+  if (!timedate.date.m)
+    timedate.date.m = 1;
+  if (!timedate.date.d)
+    timedate.date.d = 1;
+  clock_set_secs(timedate_secs(&timedate));
+
+  dst_mode = eeprom_read_byte((uint8_t *)EE_DST);
+  if (dst_mode > DST_EU)
+    dst_mode = DST_OFF;
 
   restored = 1;
 
@@ -1672,10 +3177,420 @@ static void clock_init(void)
     TIMSK2 = _BV(OCIE1A);
   }
 
+  clock_resync();
+
   // enable all interrupts!
   sei();
 }
 
+/**************************** SERIAL *****************************/
+
+/*
+ * Host time-sync protocol.  Frames are ASCII, in the style of Intel
+ * hex records:
+ *
+ *   ':' <cmd> <data bytes in hex> <checksum in hex> <CR or LF>
+ *
+ * The checksum makes the sum of the command character and every byte
+ * (checksum included) zero mod 256.  Commands are:
+ *
+ *   S yy mm dd hh mm ss ff	set date and time; ff is how much of the
+ *				current second has already elapsed, in
+ *				RTC ticks (1/128s).  This counts as a
+ *				correction for drift_learn()
+ *   G				read back date, time and RTC tick count
+ *   M				read stack high-water mark
+ *   L [hhll]			read the light level; with data, use hhll
+ *				(0000-03ff) as the ADC reading from now on
+ *				(ffff goes back to the sensor)
+ *   W				read the longest gap between watchdog kicks
+ *   T [tttt]			read the crystal temperature; with data,
+ *				use tttt (fd80-07d0, -40 to 125 C) as the
+ *				temperature from now on (8000 goes back
+ *				to the thermistor)
+ *   B				read the boot phase times
+ *   H ss bb			read input latency histogram ss (LAT_*),
+ *				buckets bb to bb+3; ss ff clears them all.
+ *				Only with LATSTATS
+ *
+ * Replies use the lower-case command letter.  's' acknowledges a set;
+ * 'g' carries yy mm dd hh mm ss tt, where tt is TCNT2 and the time
+ * includes a second the RTC interrupt is about to count; 'm' carries two
+ * 16-bit values, the stack space never used and the total space
+ * between static data and the top of RAM; 'l' carries the filtered
+ * light level (16 bits) and the brightness it gives; 'w' carries the
+ * gap in milliseconds and the source lines of the kicks either side of
+ * it, all 16 bits; 't' carries the filtered temperature in 1/16 degree
+ * C, the correction for it in 1/256 RTC ticks an hour and the fraction
+ * of a tick carried over, all 16 bits; 'b' carries the Timer1 count
+ * (BOOT_US each) at the end of each BOOT_* phase, 16 bits each; 'h'
+ * carries ss bb and the four 16-bit counts, bucket n holding latencies
+ * of 2^(n-1) to 2^n - 1 ms.  A command that is unknown or has bad
+ * data gets '!' and the command letter instead.
+ *
+ * Frames are decoded in the receive interrupt, so the RTC is sampled
+ * a fixed, short time after the final character arrives.  Converting
+ * to or from the date, changing the clock, replies and EEPROM updates
+ * are left to the main loop, to keep the interrupt short.
+ */
+#define SER_MAXDATA	10
+
+static struct serial_rx {
+  uint8_t cmd;			/* 0 = idle, ':' = want command */
+  uint8_t len;			/* hex digits received */
+  uint8_t sum;
+  uint8_t data[SER_MAXDATA + 1];	/* data plus checksum */
+} serial_rx;
+
+static volatile uint8_t serial_reply;	/* reply command, or 0 */
+static uint32_t serial_at;		/* RTC seconds when a 'G' came */
+
+/* An 'S' waiting for serial_service() */
+static struct serial_setting {
+  uint8_t d[7];			/* as sent, ff no more than the RTC counts */
+  uint32_t at;			/* RTC seconds and ticks when it came */
+  uint8_t was;
+} serial_setting;
+static volatile uint8_t serial_set;	/* serial_setting is still to apply */
+static uint8_t serial_nreply;
+static uint8_t serial_data[SER_MAXDATA];
+
+static int8_t hexval(uint8_t c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  c |= 0x20;			/* lower case */
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  return -1;
+}
+
+/* Where the RTC is, counting a second it is about to; from the interrupt */
+static uint32_t serial_rtc(uint8_t *ticks)
+{
+  uint32_t t = clock_secs;
+
+  *ticks = TCNT2;
+  /* second is over, but the RTC interrupt hasn't counted it yet */
+  if (TIFR2 & _BV(OCF2A))
+    t++;
+
+  return t;
+}
+
+/*
+ * Note the time sent and when it came, from the interrupt so it's
+ * measured when the frame arrived; serial_service() does the rest
+ */
+static uint8_t serial_set_time(const uint8_t *d)
+{
+  struct serial_setting *st = &serial_setting;
+
+  if (d[0] > 99 || d[1] < 1 || d[1] > 12 || d[2] < 1 || d[2] > 31 ||
+      d[3] > 23 || d[4] > 59 || d[5] > 59)
+    return 0;
+
+  st->at = serial_rtc(&st->was);
+  memcpy(st->d, d, sizeof(st->d));
+
+  /* no further into the second than the RTC can count */
+  if (st->d[6] >= OCR2A)
+    st->d[6] = OCR2A - 1;
+
+  serial_set = 1;
+  return 1;
+}
+
+/* Move the clock as far as an 'S' worked out */
+static void serial_apply_time(uint32_t secs, int16_t ticks)
+{
+  uint32_t t;
+
+  cli();
+  while (ASSR & _BV(TCN2UB))
+    ;
+  t = clock_secs + secs;
+  if (TIFR2 & _BV(OCF2A))
+    t++;
+  ticks += TCNT2;
+  if (ticks < 0) {
+    ticks += 128;
+    t--;
+  } else if (ticks >= 128) {
+    ticks -= 128;
+    t++;
+  }
+
+  /* a tick count at or past the compare value would never match */
+  if (ticks >= OCR2A)
+    ticks = OCR2A - 1;
+
+  /* align the RTC phase to the fractional second */
+  TCNT2 = ticks;
+  GTCCR = _BV(PSRASY);		/* restart the 32kHz prescaler too */
+  TIFR2 = _BV(OCF2A);		/* drop any stale compare match */
+  clock_secs = t;
+  sei();
+
+  clock_last = t;
+  secs_to_timedate(t, &timedate);
+  timedate_at = t;
+}
+
+/* Act on a complete frame; called from the receive interrupt */
+static void serial_command(uint8_t cmd, const uint8_t *d, uint8_t n)
+{
+  uint8_t nreply = 0;
+
+  switch (cmd) {
+  case 'S':
+    if (n != 7 || !serial_set_time(d))
+      goto bad;
+    break;
+
+  case 'G':
+    serial_at = serial_rtc(&serial_data[6]);
+    nreply = 7;			/* filled in by serial_service() */
+    break;
+
+  case 'M':
+    nreply = 4;			/* likewise */
+    break;
+
+  case 'W':
+    nreply = 6;			/* likewise */
+    break;
+
+  case 'T':
+    if (n == 2) {
+      int16_t t = (d[0] << 8) | d[1];
+
+      /* what the thermistor could give; more would overflow temp_acc */
+      if ((t < TEMP_MIN || t > TEMP_MAX) && t != TEMP_NOSIM)
+	goto bad;
+      temp_sim = t;
+    } else if (n)
+      goto bad;
+    nreply = 6;			/* likewise */
+    break;
+
+  case 'B':
+    for (nreply = 0; nreply < 2 * BOOT_NPHASES; nreply += 2) {
+      serial_data[nreply] = boot_times[nreply / 2] >> 8;
+      serial_data[nreply + 1] = boot_times[nreply / 2];
+    }
+    break;
+
+  case 'H':
+    if (!LATSTATS || n != 2 || (d[0] >= LAT_NSTAGES && d[0] != 0xff))
+      goto bad;
+    serial_data[0] = d[0];
+    serial_data[1] = d[1];
+    nreply = 10;		/* likewise */
+    break;
+
+  case 'L':
+    if (n == 2) {
+      uint16_t l = (d[0] << 8) | d[1];
+
+      /* a 10-bit ADC reading, or back to the sensor */
+      if (l > 1023 && l != LIGHT_NOSIM)
+	goto bad;
+      light_sim = l;
+    } else if (n)
+      goto bad;
+    serial_data[0] = light_acc >> (LIGHT_SHIFT + 8);
+    serial_data[1] = light_acc >> LIGHT_SHIFT;
+    serial_data[2] = light_brite(light_acc >> LIGHT_SHIFT);
+    nreply = 3;
+    break;
+
+  default:
+  bad:
+    serial_data[0] = cmd;
+    nreply = 1;
+    cmd = '!';
+    break;
+  }
+
+  serial_nreply = nreply;
+  serial_reply = cmd | 0x20;
+}
+
+SIGNAL(USART_RX_vect) {
+  struct serial_rx *rx = &serial_rx;
+  uint8_t c = UDR0;
+  int8_t v;
+
+  if (c == ':') {
+    rx->cmd = ':';
+    return;
+  }
+
+  if (rx->cmd == ':') {
+    /* command character */
+    rx->cmd = c;
+    rx->sum = c;
+    rx->len = 0;
+    return;
+  }
+
+  if (!rx->cmd)
+    return;
+
+  if (c == '\r' || c == '\n') {
+    /* need at least a checksum, and whole bytes */
+    if (rx->len >= 2 && !(rx->len & 1) && rx->sum == 0)
+      serial_command(rx->cmd, rx->data, rx->len / 2 - 1);
+    rx->cmd = 0;
+    return;
+  }
+
+  v = hexval(c);
+  if (v < 0 || rx->len >= 2 * sizeof(rx->data)) {
+    /* garbage; wait for the next frame */
+    rx->cmd = 0;
+    return;
+  }
+
+  if (rx->len & 1) {
+    uint8_t *b = &rx->data[rx->len / 2];
+
+    *b = (*b << 4) | v;
+    rx->sum += *b;
+  } else
+    rx->data[rx->len / 2] = v;
+  rx->len++;
+}
+
+static void serial_send(uint8_t cmd, const uint8_t *d, uint8_t n)
+{
+  uint8_t sum = cmd;
+
+  uart_putc(':');
+  uart_putc(cmd);
+  while (n--) {
+    uart_putc_hex(*d);
+    sum += *d++;
+  }
+  uart_putc_hex(-sum);
+  putstring_nl("");
+}
+
+/* Send any pending reply, and finish off anything the command started */
+static void serial_service(void)
+{
+  uint8_t cmd, n, set;
+  uint8_t d[SER_MAXDATA];
+  struct serial_setting st;
+  struct timedate td;
+  uint32_t at;
+
+  cli();
+  cmd = serial_reply;
+  n = serial_nreply;
+  memcpy(d, serial_data, n);
+  serial_reply = 0;
+  at = serial_at;
+  set = serial_set;
+  serial_set = 0;
+  st = serial_setting;
+  sei();
+
+  if (set) {
+    int32_t secs;
+    int16_t ticks;
+
+    td.date.y = st.d[0];
+    td.date.m = st.d[1];
+    td.date.d = st.d[2];
+    td.time.h = st.d[3];
+    td.time.m = st.d[4];
+    td.time.s = st.d[5];
+    secs = timedate_secs(&td) - st.at;
+    ticks = st.d[6] - st.was;
+    serial_apply_time(secs, ticks);
+
+    /* a day out is far too much to be drift; keep it from overflowing */
+    if (secs > 86400)
+      secs = 86400;
+    else if (secs < -86400)
+      secs = -86400;
+    drift_learn(secs * 128 + ticks, clock_now());
+    timeunknown = 0;
+
+    eeprom_write_byte((uint8_t *)EE_HOUR, timedate.time.h);
+    eeprom_write_byte((uint8_t *)EE_MIN, timedate.time.m);
+    eeprom_write_byte((uint8_t *)EE_SEC, timedate.time.s);
+    eeprom_write_byte((uint8_t *)EE_DAY, timedate.date.d);
+    eeprom_write_byte((uint8_t *)EE_MONTH, timedate.date.m);
+    eeprom_write_byte((uint8_t *)EE_YEAR, timedate.date.y);
+
+    clock_resync();
+  }
+
+  if (cmd == 'g') {
+    secs_to_timedate(at, &td);
+    d[0] = td.date.y;
+    d[1] = td.date.m;
+    d[2] = td.date.d;
+    d[3] = td.time.h;
+    d[4] = td.time.m;
+    d[5] = td.time.s;
+  }
+
+  if (cmd == 'm') {
+    uint16_t unused = stack_unused();
+    uint16_t size = stack_size();
+
+    d[0] = unused >> 8;
+    d[1] = unused;
+    d[2] = size >> 8;
+    d[3] = size;
+  }
+
+  if (cmd == 't') {
+    int16_t t = temp_level();
+    int16_t c = temp_corr(t);
+
+    d[0] = t >> 8;
+    d[1] = t;
+    d[2] = c >> 8;
+    d[3] = c;
+    d[4] = temp_frac >> 8;
+    d[5] = temp_frac;
+  }
+
+  if (LATSTATS && cmd == 'h') {
+    uint8_t i;
+
+    cli();
+    if (d[0] == 0xff)
+      memset(lat_hist, 0, sizeof(lat_hist));
+    for (i = 0; i < 4; i++) {
+      uint8_t b = d[1] + i;
+      uint16_t c = 0;
+
+      if (d[0] < LAT_NSTAGES && b < LAT_NBUCKETS)
+	c = lat_hist[d[0]][b];
+      d[2 + 2 * i] = c >> 8;
+      d[3 + 2 * i] = c;
+    }
+    sei();
+  }
+
+  if (cmd == 'w') {
+    d[0] = dog.worst >> 8;
+    d[1] = dog.worst;
+    d[2] = dog.worst_from >> 8;
+    d[3] = dog.worst_from;
+    d[4] = dog.worst_to >> 8;
+    d[5] = dog.worst_to;
+  }
+
+  serial_send(cmd, d, n);
+}
+
 void gotosleep(void) {
   // battery
   //if (sleepmode) //already asleep?
@@ -1683,6 +3598,7 @@ void gotosleep(void) {
   //DEBUGP("sleeptime");
   
   sleepmode = 1;
+  dark = 0; // wakeup() turns everything back on
   VFDSWITCH_PORT |= _BV(VFDSWITCH); // turn off display
   SPCR  &= ~_BV(SPE); // turn off spi
   VFDCLK_PORT &= ~_BV(VFDCLK) & ~_BV(VFDDATA); // no power to vfdchip
@@ -1696,6 +3612,8 @@ void gotosleep(void) {
   //beep(1760, 1);
   //beep(880, 1);
   // turn beeper off
+  tune_stop();
+  ADCSRA = 0; // and the ADC
   PORTB &= ~_BV(SPK1) & ~_BV(SPK2); 
   
   // turn off pullups
@@ -1754,16 +3672,16 @@ static void wakeup(void) {
 
    kickthedog();
 
-   // wake up sound
-   beep(880, 1);
-   beep(1760, 1);
-   beep(3520, 1);
+   // wake up sound; plays on while we carry on
+   beep(BEEP_WAKE);
 
    kickthedog();
  }
 
 
 void initbuttons(void) {
+  uint8_t sreg;
+
   DDRB =  _BV(VFDCLK) | _BV(VFDDATA) | _BV(SPK1) | _BV(SPK2);
   DDRD = _BV(BOOST) | _BV(VFDSWITCH);
   DDRC = _BV(VFDLOAD) | _BV(VFDBLANK) | _BV(4);
@@ -1774,11 +3692,18 @@ void initbuttons(void) {
   PCMSK0 = _BV(PCINT0);
   PCMSK2 = _BV(PCINT21) | _BV(PCINT20);    
 
+  // set off an interrupt if alarm is set or unset
+  EICRA = _BV(ISC00);
+  EIMSK = _BV(INT0);
+
   /* Set button FSM up for current switch state */
-  button_change_intr(BUT_MENU, !(PIND & _BV(BUTTON1)));
-  button_change_intr(BUT_SET,  !(PINB & _BV(BUTTON2)));
-  button_change_intr(BUT_NEXT, !(PIND & _BV(BUTTON3)));
-  button_change_intr(BUT_ALARM, (ALARM_PIN & _BV(ALARM)));
+  sreg = SREG;
+  cli();
+  button_change_intr(BUT_MENU, button_pin(BUT_MENU));
+  button_change_intr(BUT_SET, button_pin(BUT_SET));
+  button_change_intr(BUT_NEXT, button_pin(BUT_NEXT));
+  button_change_intr(BUT_ALARM, button_pin(BUT_ALARM));
+  SREG = sreg;
 }
 
 // When the alarm is going off, pressing a button turns on snooze mode
@@ -1786,19 +3711,30 @@ void initbuttons(void) {
 // the alarm again
 static void setsnooze(void) {
   snoozetimer = snooze * 60; // convert minutes to seconds
+  alarm_sound(0);
   DEBUGP("snooze");
-  display_str_trans("snoozing", scroll_left);
+  display_str_trans_P(PSTR("snoozing"), scroll_left);
   delayms(1000);
 }
 
 static transition_t *ui(transition_t *trans)
 {
+  timedate_sync();
+
   /* recheck alarm switch */
   if (setalarmstate())
     trans = scroll_up;
 
+  /* in dark hours, buttons just wake the display (button_sample does it) */
+  if (dark) {
+    button_sample(BUT_MENU);
+    button_sample(BUT_SET);
+    button_sample(BUT_NEXT);
+    return scroll_up;
+  }
+
   if (timeunknown && (timedate.time.s % 2))
-    display_str("        ");
+    display_str_P(PSTR("        "));
   else {
     if (alarm_on)
       display[0] |= 0x2;
@@ -1825,7 +3761,7 @@ static transition_t *ui(transition_t *trans)
       display_date(DAY);
 
       kickthedog();
-      delayms(1500);
+      display_hold(1500);
 
       trans = scroll_up;
     } 
@@ -1836,7 +3772,7 @@ static transition_t *ui(transition_t *trans)
 
 int main(void) {
   //  uint8_t i;
-  uint8_t mcustate;
+  uint8_t mcustate, mains;
   transition_t *trans;
 
   // turn boost off
@@ -1844,6 +3780,13 @@ int main(void) {
   BOOST_DDR |= _BV(BOOST);
   BOOST_PORT &= ~_BV(BOOST); // pull boost fet low
 
+  // time the boot on Timer1 until the speaker needs it
+  TIMSK1 = 0;
+  TCCR1A = 0;
+  TCCR1B = 0;
+  TCNT1 = 0;
+  TCCR1B = _BV(CS11) | _BV(CS10);
+
   // check if we were reset
   mcustate = MCUSR;
   MCUSR = 0;
@@ -1853,7 +3796,7 @@ int main(void) {
   //WDTCSR |= _BV(WDP0) | _BV(WDP1) | _BV(WDP2);
   //WDTCSR = _BV(WDE);
   wdt_enable(WDTO_2S);
-  kickthedog();
+  wdt_reset();
 
   if (mcustate & (PORF | EXTRF | BORF | WDRF)) {
     /* We got restarted by an actual reset so we may have lost time.
@@ -1865,48 +3808,55 @@ int main(void) {
   // have we read the time & date from eeprom?
   restored = 0;
 
-  // setup uart
+  // setup uart; anything to say waits until the time is showing
   uart_init(BRRL_192);
-  //DEBUGP("VFD Clock");
-  DEBUGP("!");
+  UCSR0B |= _BV(RXCIE0);	// host time sync
 
   //DEBUGP("turning on anacomp");
   // set up analog comparator
   ACSR = _BV(ACBG) | _BV(ACIE); // use bandgap, intr. on toggle!
   _delay_ms(1);
   // settle!
-  if (ACSR & _BV(ACO)) {
+  mains = !(ACSR & _BV(ACO));
+  if (!mains) {
     // hmm we should not interrupt here
     ACSR |= _BV(ACI);
 
     // even in low power mode, we run the clock 
-    DEBUGP("clock init");
   } else {
     // we aren't in low power mode so init stuff
 
-    // init io's
+    // init io's and button interrupts
     initbuttons();
     
     VFDSWITCH_PORT &= ~_BV(VFDSWITCH);
     
-    DEBUGP("turning on buttons");
-    // set up button interrupts
-    DEBUGP("turning on alarmsw");
-    // set off an interrupt if alarm is set or unset
-    EICRA = _BV(ISC00);
-    EIMSK = _BV(INT0);
-  
     load_brite();
-
-    DEBUGP("vfd init");
     vfd_init();
-    
-    DEBUGP("boost init");
-    boost_init();
-    sei();
 
     region = eeprom_read_byte((uint8_t *)EE_REGION);
     secondmode = eeprom_read_byte((uint8_t *)EE_SECONDMODE);
+    time_plan_build();
+  }
+  boot_mark(BOOT_POWER);
+
+  clock_init();
+  boot_mark(BOOT_CLOCK);
+
+  if (mains) {
+    // show the restored time, then light the tube
+    display_time(flip);
+    boost_init();
+    boot_mark(BOOT_FRAME);
+  } else
+    TCCR1B = 0;		// the speaker won't be taking Timer1 back
+
+  // the rest can wait until something is showing
+  dog_report(mcustate);
+  //DEBUGP("VFD Clock");
+  DEBUGP("!");
+
+  if (mains) {
     snooze = eeprom_read_byte((uint8_t *)EE_SNOOZE);
     if (snooze > 60)
       snooze = MAXSNOOZE / 60;
@@ -1915,22 +3865,22 @@ int main(void) {
 
     // read the preferences for high/low volume
     volume = eeprom_read_byte((uint8_t *)EE_VOLUME);
-    speaker_init();
+    boot_mark(BOOT_DONE);
+    speaker_init();		/* takes Timer1 from boot_mark() */
 
     if (timeunknown)
-      beep(4000, 1);
+      beep(BEEP_ONE);
   }
   
   SMCR = _BV(SE); // idle mode
   
-  DEBUGP("clock init");
-  clock_init();
-    
   DEBUGP("done");
   trans = flip;
   while (1) {
     kickthedog();
 
+    clock_update();
+
     //uart_putc_hex(ACSR);
     if (ACSR & _BV(ACO)) {
       // DEBUGP("SLEEPYTIME");
@@ -1939,8 +3889,12 @@ int main(void) {
     }
     //DEBUGP(".");
 
+    serial_service();
+
     trans = ui(trans);
 
+    adc_service();
+
     /*
      * Sleep until something interesting happens (ie, an interrupt;
      * all changes are interrupt driven).  This is also a barrier, so
@@ -1961,25 +3915,31 @@ static void display_alarm_days(transition_t *trans)
 // set. It also displays the alarm time
 static uint8_t setalarmstate(void) {
   uint8_t want = button_poll(BUT_ALARM);
+  uint8_t num = alarm_num;
 
+  alarm_switched = 0;
   if (want == alarm_on)
     return 0;
 
   alarm_on = want;
   snoozetimer = 0;
+  dark_wakeup();
 
   if (want) {
       // show the status on the VFD tube
-      display_str_trans("alarm on", scroll_up);
+      display_str_trans_P(PSTR("alarm on"), scroll_up);
       // its not actually SHOW_SNOOZE but just anything but SHOW_TIME
       delayms(1000);
-      // show the current alarm time set
+      // show the alarm that goes off next, then put back the one
+      // the alarm menu had chosen
       kickthedog();
+      alarm_num = alarm_due + 1;
       display_alarm(scroll_left);
       delayms(1000);
       kickthedog();
       display_alarm_days(scroll_left);
       delayms(1000);
+      alarm_select(num);
       // after a second, go back to clock mode
       return 1;
   } else {
@@ -1992,14 +3952,187 @@ static uint8_t setalarmstate(void) {
       /* No alarm, normal brightness */
       set_brite();
 
-      TCCR1B &= ~_BV(CS11); // turn it off!
-      PORTB |= _BV(SPK1) | _BV(SPK2);
+      alarm_sound(0);
     } 
   }
   return 0;
 }
 
 /**************************** SPEAKER *****************************/
+
+/*
+ * Tunes are played by a sequencer running off Timer1's overflow
+ * interrupt, which comes once per period of the note playing.  Note
+ * tables live in PROGMEM with ICR1 and the length in periods worked
+ * out by the compiler, so nothing is divided at run time.
+ */
+struct note {
+  uint16_t icr;			/* Timer1 TOP, or 0 for a rest */
+  uint16_t periods;		/* length in periods; 0 ends the tune */
+};
+
+#define TONE_CLOCK	(F_CPU / 8)
+#define REST_ICR	(TONE_CLOCK / 1000)	/* rests count milliseconds */
+#define NOTE(hz, ms)	{ TONE_CLOCK / (hz), (uint32_t)(hz) * (ms) / 1000 }
+#define REST(ms)	{ 0, (ms) }
+#define TUNE_END	{ 0, 0 }
+
+/* Starts like the old alarm, then gets more insistent */
+static const struct note alarm_tune[] PROGMEM = {
+  NOTE(4000, 1000), REST(1000),
+  NOTE(4000, 1000), REST(1000),
+  NOTE(4000, 1000), REST(1000),
+#define ALARM_LOOP	6		/* repeats from here */
+  NOTE(4000, 150), REST(100), NOTE(4000, 150), REST(100),
+  NOTE(4000, 150), REST(100), NOTE(4000, 150), REST(600),
+  TUNE_END
+};
+
+static const struct note beep_one[] PROGMEM = {
+  NOTE(4000, 200), REST(200), TUNE_END
+};
+
+static const struct note beep_wake[] PROGMEM = {
+  NOTE(880, 200), REST(200),
+  NOTE(1760, 200), REST(200),
+  NOTE(3520, 200), REST(200),
+  TUNE_END
+};
+
+/* A single 50Hz period pushes the piezo one way then back: a click */
+static const struct note beep_click[] PROGMEM = {
+  NOTE(50, 20), TUNE_END
+};
+
+/* Indexed by BEEP_* */
+static const struct note * const beeps[] PROGMEM = {
+  beep_one, beep_wake, beep_click,
+};
+
+static const struct note *tune_next;	/* next note; NULL when quiet */
+static const struct note *tune_loop;	/* where to repeat from, or NULL */
+static uint16_t tune_left;		/* periods left of this note */
+static uint8_t speaker_com;		/* TCCR1A output bits for volume */
+
+/* Tunes waiting to play once the current one ends */
+#define NTUNES	4
+static const struct note *tune_queue[NTUNES];
+static uint8_t tune_qhead, tune_qlen;
+
+static void tune_quiet(void)
+{
+  TIMSK1 = 0;
+  TCCR1B &= ~_BV(CS11);
+  TCCR1A = speaker_com | _BV(WGM11);
+  PORTB &= ~_BV(SPK1) & ~_BV(SPK2);
+  tune_next = NULL;
+  tune_qlen = 0;
+}
+
+/* Start the next note; from the interrupt, or with interrupts off */
+static void tune_step(void)
+{
+  uint16_t icr, n;
+
+  for (;;) {
+    icr = pgm_read_word(&tune_next->icr);
+    n = pgm_read_word(&tune_next->periods);
+    if (n)
+      break;
+    if (tune_loop)
+      tune_next = tune_loop;
+    else if (tune_qlen) {
+      tune_next = tune_queue[tune_qhead];
+      tune_qhead = (tune_qhead + 1) % NTUNES;
+      tune_qlen--;
+    } else {
+      tune_quiet();
+      return;
+    }
+  }
+  tune_next++;
+  tune_left = n;
+
+  /*
+   * ICR1 isn't buffered in this mode, but the counter has only just
+   * wrapped, so it can't already be past the new TOP.
+   */
+  if (icr) {
+    ICR1 = icr;
+    OCR1A = OCR1B = icr / 2;
+    TCCR1A = speaker_com | _BV(WGM11);
+  } else {
+    /* a rest keeps the timer counting, with the outputs off */
+    ICR1 = REST_ICR;
+    TCCR1A = _BV(WGM11);
+    PORTB &= ~_BV(SPK1) & ~_BV(SPK2);
+  }
+}
+
+SIGNAL(TIMER1_OVF_vect)
+{
+  if (!--tune_left)
+    tune_step();
+}
+
+/* Start a tune now, with interrupts off */
+static void tune_start(const struct note *tune, const struct note *loop)
+{
+  tune_next = tune;
+  tune_loop = loop;
+  TCNT1 = 0;
+  tune_step();
+  if (tune_next) {
+    TIFR1 = _BV(TOV1);
+    TIMSK1 = _BV(TOIE1);
+    TCCR1B |= _BV(CS11);
+  }
+}
+
+/* Play a tune in place of anything playing or queued */
+static void tune_play(const struct note *tune, const struct note *loop)
+{
+  cli();
+  tune_qlen = 0;
+  tune_start(tune, loop);
+  sei();
+}
+
+void tune_stop(void)
+{
+  cli();
+  tune_quiet();
+  sei();
+}
+
+/*
+ * Queue one of the BEEP_* sounds after whatever is playing, and
+ * return at once; the Timer1 interrupt times it.  If the queue is
+ * full, the beep is dropped.
+ */
+void beep(uint8_t sound)
+{
+  const struct note *tune = (const struct note *)pgm_read_word(&beeps[sound]);
+
+  cli();
+  if (!tune_next)
+    tune_start(tune, NULL);
+  else if (tune_qlen < NTUNES)
+    tune_queue[(tune_qhead + tune_qlen++) % NTUNES] = tune;
+  sei();
+}
+
+// Start or stop the alarm sound; harmless to repeat
+void alarm_sound(uint8_t on)
+{
+  uint8_t playing = tune_next && tune_loop == alarm_tune + ALARM_LOOP;
+
+  if (on && !playing)
+    tune_play(alarm_tune, alarm_tune + ALARM_LOOP);
+  else if (!on && playing)
+    tune_stop();
+}
+
 // Set up the speaker to prepare for beeping!
 void speaker_init(void) {
 
@@ -2007,10 +4140,11 @@ void speaker_init(void) {
   PORTB |= _BV(SPK1) | _BV(SPK2); 
 
   // Turn on PWM outputs for both pins
-  TCCR1A = _BV(COM1B1) | _BV(COM1B0) | _BV(WGM11);
+  speaker_com = _BV(COM1B1) | _BV(COM1B0);
   if (volume) {
-    TCCR1A |= _BV(COM1A1);
+    speaker_com |= _BV(COM1A1);
   } 
+  tune_stop();
   TCCR1B = _BV(WGM13) | _BV(WGM12);
 
   // start at 4khz:  250 * 8 multiplier * 4000 = 8mhz
@@ -2018,44 +4152,9 @@ void speaker_init(void) {
   OCR1B = OCR1A = ICR1 / 2;
 }
 
-// This makes the speaker tick, it doesnt use PWM
-// instead it just flicks the piezo
+// This makes the speaker tick, for button feedback
 void tick(void) {
-  TCCR1A = 0;
-  TCCR1B = 0;
-
-  // Send a pulse thru both pins, alternating
-  SPK_PORT |= _BV(SPK1);
-  SPK_PORT &= ~_BV(SPK2);
-  delayms(10);
-  SPK_PORT |= _BV(SPK2);
-  SPK_PORT &= ~_BV(SPK1);
-  delayms(10);
-  // turn them both off
-  SPK_PORT &= ~_BV(SPK1) & ~_BV(SPK2);
-
-  TCCR1A = _BV(COM1A1) | _BV(COM1B1) | _BV(COM1B0) | _BV(WGM11);
-  TCCR1B = _BV(WGM13) | _BV(WGM12);
-}
-
-// We can play short beeps!
-void beep(uint16_t freq, uint8_t times) {
-  // set the PWM output to match the desired frequency
-  ICR1 = (F_CPU/8)/freq;
-  // we want 50% duty cycle square wave
-  OCR1A = OCR1B = ICR1/2;
-   
-  while (times--) {
-    TCCR1B |= _BV(CS11); // turn it on!
-    // beeps are 200ms long on
-    _delay_ms(200);
-    TCCR1B &= ~_BV(CS11); // turn it off!
-    PORTB &= ~_BV(SPK1) & ~_BV(SPK2);
-    // beeps are 200ms long off
-    _delay_ms(200);
-  }
-  // turn speaker off
-  PORTB &= ~_BV(SPK1) & ~_BV(SPK2);
+  beep(BEEP_CLICK);
 }
 
 
@@ -2080,55 +4179,82 @@ void boost_init(void) {
 
 /**************************** DISPLAY *****************************/
 
-// display words (menus, prompts, etc)
-static unsigned char __display_str(uint8_t *disp, const char *s)
+// Segments for a character; anything outside the font is blank
+static uint8_t glyph(char c)
+{
+  uint8_t i = c - FONT_FIRST;
+
+  return i < FONT_SIZE ? pgm_read_byte(font + i) : 0;
+}
+
+/*
+ * display words (menus, prompts, etc), straight from RAM or PROGMEM.
+ * A '.' goes on the previous character where there is one.
+ */
+static unsigned char render_str(uint8_t *disp, const char *s, uint8_t progmem,
+				uint8_t max)
 {
   unsigned char len = 0;
+  char c;
 
-  while(disp < (display+DISPLAYSIZE) && *s) {
-    char c = *s;
-
-    // Numbers and leters are looked up in the font table!
-    if ((c >= 'a') && (c <= 'z')) {
-      *disp =  pgm_read_byte(alphatable + c - 'a');
-    } else if ((c >= '0') && (c <= '9')) {
-      *disp =  pgm_read_byte(numbertable + c - '0');
-    } else if (c == '-') {
-      *disp = 1<<D0G;
-    } else if (c == '.') {
-      if (disp > display) {
-	/* If possible, add '.' to previous character */
-	disp--;
-	len--;
-      }
-      *disp = 1<<D0H;
+  while (len < max && (c = progmem ? pgm_read_byte(s) : *s)) {
+    if (c == '.' && len) {
+      disp[-1] |= 1<<D0H;
     } else {
-      *disp = 0;      // spaces and other stuff are ignored :(
+      *disp++ = glyph(c);
+      len++;
     }
-
-    disp++;
     s++;
-    len++;
   }
 
   return len;
 }
 
-void display_str_trans(const char *s, transition_t *trans)
+static unsigned char __display_str_P(uint8_t *disp, const char *s)
+{
+  return render_str(disp, s, 1, display + DISPLAYSIZE - disp);
+}
+
+/*
+ * Show n characters rendered into marquee[], scrolling them if they
+ * don't fit.  The transition brings in the start of the text.
+ */
+static void display_marquee(uint8_t n, transition_t *trans)
 {
-  uint8_t i, len;
+  uint8_t fit = n < DISPLAYSIZE - 1 ? n : DISPLAYSIZE - 1;
+  uint8_t i;
 
   // don't use the lefthand dot/slash digit
   display[0] = 0;
 
-  len = __display_str(display+1, s);
-  for (i = len+1; i < DISPLAYSIZE; i++)
+  memcpy(display+1, marquee, fit);
+  for (i = fit+1; i < DISPLAYSIZE; i++)
     display[i] = 0;
 
   flip_display(trans);
+
+  if (n > fit)
+    marquee_start(n);
+}
+
+void display_str_trans(const char *s, transition_t *trans)
+{
+  marquee_stop();
+  display_marquee(render_str(marquee, s, 0, MARQUEE_MAX), trans);
+}
+
+void display_str_trans_P(const char *s, transition_t *trans)
+{
+  marquee_stop();
+  display_marquee(render_str(marquee, s, 1, MARQUEE_MAX), trans);
 }
 
 void display_str(const char *s)
 {
   display_str_trans(s, flip);
 }
+
+void display_str_P(const char *s)
+{
+  display_str_trans_P(s, flip);
+}
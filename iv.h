@@ -31,9 +31,25 @@ THE SOFTWARE.
 #define BRITE_MAX	90
 #define BRITE_STEP	5
 
+// Regulate the boost converter from a divider on BOOST_ADC, holding a
+// voltage for each brightness level; otherwise brightness is just the
+// boost duty cycle.  Needs the divider fitted.
+#define BOOST_FEEDBACK 0
+#define BOOST_VMIN	30	// volts at BRITE_MIN
+#define BOOST_VMAX	50	// volts at BRITE_MAX
+
+// Keep histograms of button-to-display latency, read over the serial
+// port with latency.pl
+#define LATSTATS 0
+
 #define REGION_US 0
 #define REGION_EU 1
 
+// daylight saving rules
+#define DST_OFF 0
+#define DST_US 1   // 2nd Sunday March - 1st Sunday November, 2am
+#define DST_EU 2   // last Sunday March 2am - last Sunday October 3am
+
 // date format
 #define DATE 0  // mm-dd-yy
 #define DAY 1   // thur jan 1
@@ -42,6 +58,7 @@ THE SOFTWARE.
 
 #define MAXSNOOZE 600 // 10 minutes
 #define INACTIVITYTIMEOUT 10 // how many seconds we will wait before turning off menus
+#define DARK_WAKE 60 // seconds a button keeps the display on in dark hours
 
 
 #define BEEP_8KHZ 5
@@ -65,6 +82,9 @@ THE SOFTWARE.
 #define DAYS_WEEKEND	(DAY_SAT | DAY_SUN)
 #define DAYS_WEEK	(DAY_MON | DAY_TUE | DAY_WED | DAY_THUR | DAY_FRI)
 #define DAYS_ALL	(DAYS_WEEKEND | DAYS_WEEK)
+#define DAYS_NONE	0
+
+#define NALARMS		3
 
 #define EE_YEAR 1
 #define EE_MONTH 2
@@ -84,6 +104,14 @@ THE SOFTWARE.
 #define EE_DAYBRITE 16
 #define EE_NIGHTBRITE 17
 #define EE_DRIFT 18
+#define EE_DST 19
+#define EE_ALARMS 20	/* hour, min, days of alarms 2 on; alarm 1 is at EE_ALARM_HOUR */
+#define EE_AUTOBRITE (EE_ALARMS + 3 * (NALARMS - 1))
+#define EE_DARKSTART (EE_AUTOBRITE + 1)
+#define EE_DARKEND (EE_AUTOBRITE + 2)
+#define EE_TEMPCOMP (EE_AUTOBRITE + 3)
+#define EE_LEARNFROM (EE_AUTOBRITE + 4)	/* 4 bytes, start of drift learning */
+#define EE_LEARNERR (EE_AUTOBRITE + 8)	/* 4 bytes, ticks corrected since */
 
 #define DRIFT_MIN	(-64)
 #define DRIFT_MAX	(64)
@@ -99,6 +127,8 @@ void speaker_init(void);
 typedef uint8_t (transition_t)(uint8_t *);
 void display_str(const char *s);
 void display_str_trans(const char *s, transition_t *trans);
+void display_str_P(const char *s);
+void display_str_trans_P(const char *s, transition_t *trans);
 
 void set_time(void);
 void set_alarm(void);
@@ -107,8 +137,13 @@ void set_brightness(void);
 void set_volume(void);
 void set_region(void);
 
-void beep(uint16_t freq, uint8_t times);
+#define BEEP_ONE	0	/* one short beep */
+#define BEEP_WAKE	1	/* three rising beeps */
+#define BEEP_CLICK	2	/* key click */
+void beep(uint8_t sound);
 void tick(void);
+void alarm_sound(uint8_t on);
+void tune_stop(void);
 
 #define BOOST PD6
 #define BOOST_DDR DDRD
@@ -139,6 +174,16 @@ void tick(void);
 #define ALARM_PORT PORTD
 #define ALARM_PIN PIND
 
+// ambient light sensor: LDR from VCC to PC5, 10k from PC5 to ground
+#define LIGHT_ADC 5
+// crystal thermistor: 10k NTC from VCC to PC1, 10k from PC1 to ground;
+// mount it against the crystal can
+#define TEMP_ADC 1
+// boost output divider: 1M from the boost output to PC2, 82k to ground
+#define BOOST_ADC 2
+#define BOOST_R1 1000
+#define BOOST_R2 82
+
 #define SPK1 PB1
 #define SPK2 PB2
 #define SPK_PORT PORTB
@@ -0,0 +1,113 @@
+#!/usr/bin/perl
+#
+# Read the button-to-display latency histograms from a clock built
+# with LATSTATS, over the serial port.  See the SERIAL section of iv.c
+# for the frame format and the 'H' command.
+#
+# usage: latency.pl [-c] /dev/ttyUSB0
+#	-c	clear the histograms after reading them
+
+use strict;
+use Getopt::Std;
+
+my %opt;
+(getopts('c', \%opt) && @ARGV == 1)
+    or die "usage: $0 [-c] device\n";
+my $dev = $ARGV[0];
+
+my @STAGES = ('debounce (edge to latch)', 'poll (latch to sample)',
+	      'respond (sample to frame)', 'transition');
+my $NBUCKETS = 12;			# LAT_NBUCKETS
+
+# 19200 baud, 8 data bits, 2 stop bits; see uart_init()
+system('stty', '-F', $dev, 19200, 'raw', '-echo', 'cs8', 'cstopb',
+       '-parenb') == 0 or die "$0: can't set up $dev\n";
+open(my $fh, '+<', $dev) or die "$0: $dev: $!\n";
+binmode $fh;
+my $fd = fileno($fh);
+
+sub frame {
+    my ($cmd, @data) = @_;
+    my $sum = ord($cmd);
+
+    $sum += $_ foreach @data;
+    return ':' . $cmd . join('', map { sprintf('%02x', $_) } @data) .
+	sprintf("%02x\n", -$sum & 0xff);
+}
+
+# send a frame and wait for the reply with command $want
+sub query {
+    my ($want, $f) = @_;
+    my $line = '';
+    my $rin = '';
+
+    syswrite($fh, $f) == length($f) or die "$0: write: $!\n";
+    vec($rin, $fd, 1) = 1;
+    while (select(my $rout = $rin, undef, undef, 2)) {
+	sysread($fh, my $c, 1) or last;
+	if ($c ne "\n" && $c ne "\r") {
+	    $line .= $c;
+	    next;
+	}
+
+	# the clock also prints debug messages; skip anything else
+	if ($line =~ /^:$want((?:[0-9a-f]{2})+)$/i) {
+	    my @b = map { hex } unpack('(A2)*', $1);
+	    my $sum = ord($want);
+
+	    $sum += $_ foreach @b;
+	    die "$0: bad checksum in '$line'\n" if $sum & 0xff;
+	    pop @b;
+	    return @b;
+	}
+	$line = '';
+    }
+    die "$0: no '$want' reply; is the clock built with LATSTATS?\n";
+}
+
+sub range {
+    my $b = shift;
+
+    return '0' if !$b;
+    return '1' if $b == 1;
+    return sprintf('%d+', 1 << ($b - 1)) if $b == $NBUCKETS - 1;
+    return sprintf('%d-%d', 1 << ($b - 1), (1 << $b) - 1);
+}
+
+for my $s (0 .. $#STAGES) {
+    my @count;
+
+    for (my $b = 0; $b < $NBUCKETS; $b += 4) {
+	my @r = query('h', frame('H', $s, $b));
+	splice(@r, 0, 2);
+	push @count, map { ($r[2 * $_] << 8) | $r[2 * $_ + 1] } 0 .. 3;
+    }
+    splice(@count, $NBUCKETS);
+
+    my $n = 0;
+    $n += $_ foreach @count;
+    print "$STAGES[$s]: $n\n";
+    next unless $n;
+
+    # percentiles, as the bucket they fall in
+    my $sum = 0;
+    my %pct;
+    for my $b (0 .. $#count) {
+	$sum += $count[$b];
+	for my $p (50, 90, 99) {
+	    $pct{$p} //= range($b) if $sum * 100 >= $n * $p;
+	}
+    }
+    printf "  p50 %sms, p90 %sms, p99 %sms\n", @pct{50, 90, 99};
+
+    for my $b (0 .. $#count) {
+	next unless $count[$b];
+	printf "  %9sms %6d %s\n", range($b), $count[$b],
+	    '#' x int(50 * $count[$b] / $n + 0.5);
+    }
+}
+
+if ($opt{c}) {
+    query('h', frame('H', 0xff, 0));
+    print "cleared\n";
+}
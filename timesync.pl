@@ -0,0 +1,107 @@
+#!/usr/bin/perl
+#
+# Set the clock from the host's time over the serial port, then
+# report how far the clock is from the host.  See the SERIAL section
+# of iv.c for the frame format.
+#
+# usage: timesync.pl [-q] [-n samples] /dev/ttyUSB0
+#	-q	query only, don't set the time
+#	-n	number of offset samples to take (default 5)
+
+use strict;
+use POSIX qw(mktime floor tcdrain);
+use Time::HiRes qw(time sleep);
+use Getopt::Std;
+
+my %opt;
+(getopts('qn:', \%opt) && @ARGV == 1)
+    or die "usage: $0 [-q] [-n samples] device\n";
+my $dev = $ARGV[0];
+my $samples = $opt{n} || 5;
+
+# 19200 baud, 8 data bits, 2 stop bits; see uart_init()
+my $BAUD = 19200;
+my $CHARTIME = (1 + 8 + 2) / $BAUD;
+my $TICKS = 128;			# RTC ticks per second
+
+system('stty', '-F', $dev, $BAUD, 'raw', '-echo', 'cs8', 'cstopb',
+       '-parenb') == 0 or die "$0: can't set up $dev\n";
+open(my $fh, '+<', $dev) or die "$0: $dev: $!\n";
+binmode $fh;
+my $fd = fileno($fh);
+
+sub frame {
+    my ($cmd, @data) = @_;
+    my $sum = ord($cmd);
+
+    $sum += $_ foreach @data;
+    return ':' . $cmd . join('', map { sprintf('%02x', $_) } @data) .
+	sprintf("%02x\n", -$sum & 0xff);
+}
+
+# send a frame, returning the time its last character went out
+sub send_frame {
+    my $f = shift;
+
+    syswrite($fh, $f) == length($f) or die "$0: write: $!\n";
+    tcdrain($fd);
+    return time;
+}
+
+# wait for a reply frame with command $want; returns its data bytes
+sub reply {
+    my $want = shift;
+    my $line = '';
+    my $rin = '';
+
+    vec($rin, $fd, 1) = 1;
+    while (select(my $rout = $rin, undef, undef, 2)) {
+	sysread($fh, my $c, 1) or last;
+	if ($c ne "\n" && $c ne "\r") {
+	    $line .= $c;
+	    next;
+	}
+
+	# the clock also prints debug messages; skip anything else
+	if ($line =~ /^:$want((?:[0-9a-f]{2})+)$/i) {
+	    my @b = map { hex } unpack('(A2)*', $1);
+	    my $sum = ord($want);
+
+	    $sum += $_ foreach @b;
+	    die "$0: bad checksum in '$line'\n" if $sum & 0xff;
+	    pop @b;
+	    return @b;
+	}
+	$line = '';
+    }
+    die "$0: no '$want' reply from clock\n";
+}
+
+sub set_time {
+    # fields are sent for the moment the final character arrives
+    my $len = length(frame('S', (0) x 7));
+    my $t = time + $len * $CHARTIME;
+    my $sec = floor($t);
+    my @tm = localtime($sec);
+    my $ticks = int(($t - $sec) * $TICKS);
+
+    send_frame(frame('S', $tm[5] % 100, $tm[4] + 1, $tm[3],
+		     $tm[2], $tm[1], $tm[0], $ticks));
+    reply('s');
+    printf "set %s + %d/%d\n", scalar(localtime($sec)), $ticks, $TICKS;
+}
+
+sub offset {
+    my $sent = send_frame(frame('G'));
+    my ($y, $mon, $d, $h, $m, $s, $ticks) = reply('g');
+    my $clock = mktime($s, $m, $h, $d, $mon - 1, $y + 100, 0, 0, -1);
+
+    return $clock + $ticks / $TICKS - $sent;
+}
+
+set_time() unless $opt{q};
+
+for (1 .. $samples) {
+    sleep(0.5);
+    printf "offset %+.3fs\n", offset();
+}
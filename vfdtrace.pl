@@ -0,0 +1,262 @@
+#!/usr/bin/perl
+#
+# Measure display refresh from a VCD trace of the MAX6921 interface.
+# The words shifted into the MAX6921 are decoded back into digits and
+# segments using the pin tables in iv.c/iv.h, and each latch (VFDLOAD
+# rising) is taken as the start of that digit's on-time, which lasts
+# until the next latch while VFDBLANK is low.
+#
+# The trace needs LOAD and BLANK, plus either SCK and MOSI (a logic
+# analyser, or a pin-level simulator) or SPDR, the data register, as
+# traced by simavr from a SIMTRACE build ("make vfdtrace").  simavr logs
+# changes to SPDR rather than writes, so a byte written twice in a row
+# shows up once.  Each word is 24 bits, three bytes, so a latch that
+# didn't see exactly that many shifted in is skipped and counted.
+#
+# In a simavr trace, how long each SPI byte takes comes from simavr's
+# model of the SPI, not the real 8MHz/16 (SPR0) shift clock, so the
+# times are the simulator's; only a logic analyser trace gives the
+# hardware's.
+#
+# usage: vfdtrace.pl [-b usec] [-f] trace.vcd
+#	-b	histogram bucket width in microseconds (default 50)
+#	-f	also list each frame, as text, when it changes
+
+use strict;
+use Getopt::Std;
+
+my %opt;
+(getopts('b:f', \%opt) && @ARGV == 1)
+    or die "usage: $0 [-b usec] [-f] trace.vcd\n";
+my $bucket = ($opt{b} || 50) * 1e-6;
+
+# --- pin tables, from the firmware source ---
+
+my (%pin, @digitpin, @segpin, %glyph);
+
+open(my $h, '<', 'iv.h') or die "$0: iv.h: $!\n";
+while (<$h>) {
+    $pin{$1} = $2 if /^#define\s+((?:SEG|DIG)_\w+)\s+(\d+)/;
+}
+close $h;
+
+open(my $c, '<', 'iv.c') or die "$0: iv.c: $!\n";
+my $src = do { local $/; <$c> };
+close $c;
+$src =~ /digittable\[\]\s*PROGMEM\s*=\s*\{([^}]*)\}/
+    or die "$0: no digittable in iv.c\n";
+@digitpin = map { $pin{$_} } ($1 =~ /(DIG_\w+)/g);
+$src =~ /segmenttable\[\]\s*PROGMEM\s*=\s*\{([^}]*)\}/
+    or die "$0: no segmenttable in iv.c\n";
+@segpin = map { $pin{$_} } ($1 =~ /(SEG_\w+)/g);
+
+# font, for showing frames as text; digits and lowercase win
+if (open(my $f, '<', 'fonttable.h')) {
+    while (<$f>) {
+	next unless m{^\s*0x([0-9A-Fa-f]{2}),\s*/\* (.) \*/};
+	my ($g, $ch) = (hex $1, $2);
+	$glyph{$g} = $ch
+	    if !defined $glyph{$g} || ($ch =~ /[0-9a-z]/ &&
+				      $glyph{$g} !~ /[0-9a-z]/);
+    }
+    close $f;
+}
+
+# word latched into the MAX6921 -> (digit, segments)
+sub decode {
+    my $w = shift;
+    my ($digit, $segs) = (-1, 0);
+
+    for my $d (0 .. $#digitpin) {
+	next unless $w & (1 << $digitpin[$d]);
+	$digit = $digit < 0 ? $d : -2;		# -2: more than one
+    }
+    for my $s (0 .. $#segpin) {
+	$segs |= 1 << $s if $w & (1 << $segpin[$s]);
+    }
+    return ($digit, $segs);
+}
+
+# --- VCD ---
+
+my (%sig, %val, $scale);
+my $t = 0;
+my $sr = 0;				# MAX6921 shift register
+my $nbits = 0;				# bits shifted in since the last latch
+my @latch;				# [time, word, bits]
+my @blank;				# [time, level] changes
+
+sub change {
+    my ($name, $v) = @_;
+    my $old = $val{$name};
+
+    $val{$name} = $v;
+    if ($name eq 'SPDR') {
+	$sr = (($sr << 8) | $v) & 0xffffff;
+	$nbits += 8;
+    } elsif ($name eq 'SCK') {
+	if ($v && defined $old && !$old) {
+	    $sr = (($sr << 1) | ($val{MOSI} & 1)) & 0xffffff;
+	    $nbits++;
+	}
+    } elsif ($name eq 'LOAD') {
+	if ($v && defined $old && !$old) {
+	    push @latch, [$t * $scale, $sr & 0xfffff, $nbits];
+	    $nbits = 0;
+	}
+    } elsif ($name eq 'BLANK') {
+	push @blank, [$t * $scale, $v];
+    }
+}
+
+my %unit = (s => 1, ms => 1e-3, us => 1e-6, ns => 1e-9, ps => 1e-12,
+	    fs => 1e-15);
+
+open(my $v, '<', $ARGV[0]) or die "$0: $ARGV[0]: $!\n";
+my $hdr = '';
+while (<$v>) {
+    $hdr .= $_;
+    last if /\$enddefinitions/;
+}
+$hdr =~ /\$timescale\s*(\d+)\s*(\w+)\s*\$end/
+    or die "$0: no \$timescale\n";
+$scale = $1 * $unit{$2};
+while ($hdr =~ /\$var\s+\w+\s+\d+\s+(\S+)\s+(\S+)/g) {
+    my ($id, $name) = ($1, uc $2);
+    $name =~ s/.*[.\/]//;			# drop any scope prefix
+    $sig{$id} = $name
+	if $name =~ /^(SPDR|SCK|MOSI|LOAD|BLANK)$/;
+}
+die "$0: trace has no LOAD signal\n" unless grep { $_ eq 'LOAD' } values %sig;
+
+while (<$v>) {
+    my @tok = split;
+
+    while (defined(my $tok = shift @tok)) {
+	if ($tok =~ /^#(\d+)/) {
+	    $t = $1;
+	} elsif ($tok =~ /^b([01xz]+)$/i) {
+	    my ($bits, $id) = ($1, shift @tok);
+	    next unless defined $id && $sig{$id};
+	    $bits =~ tr/xzXZ/0000/;
+	    change($sig{$id}, oct("0b$bits"));
+	} elsif ($tok =~ /^([01xz])(.+)$/i && $sig{$2}) {
+	    change($sig{$2}, $1 eq '1' ? 1 : 0);
+	}
+    }
+}
+close $v;
+
+die "$0: no latches in trace\n" if @latch < 2;
+
+# --- on-times ---
+
+# time within [a, b) that BLANK was low (BLANK never traced: always)
+sub lit {
+    my ($a, $b) = @_;
+    my $level = 0;
+    my $from = $a;
+    my $sum = 0;
+
+    for my $e (@blank) {
+	my ($bt, $bv) = @$e;
+	if ($bt <= $a) {
+	    $level = $bv;
+	    next;
+	}
+	last if $bt >= $b;
+	$sum += $bt - $from unless $level;
+	($from, $level) = ($bt, $bv);
+    }
+    $sum += $b - $from unless $level;
+    return $sum;
+}
+
+my (%on, %last, %period, @frame, $shown, %bad);
+
+for my $i (0 .. $#latch - 1) {
+    my ($lt, $w, $nb) = @{$latch[$i]};
+    my ($d, $segs) = decode($w);
+
+    if ($nb != 24) {
+	$bad{"$nb bits shifted in"}++;
+	next;
+    }
+    if ($d < 0) {
+	$bad{$d == -1 ? 'no digit' : 'several digits'}++;
+	next;
+    }
+    push @{$on{$d}}, lit($lt, $latch[$i + 1][0]);
+    push @{$period{$d}}, $lt - $last{$d} if defined $last{$d};
+    $last{$d} = $lt;
+
+    if ($opt{f}) {
+	$frame[$d] = $segs;
+	my $text = join('', map { defined $_ ? ($_ ? ($glyph{$_ & 0xfe} //
+						     '?') : ' ') : ' ' }
+			@frame[1 .. $#digitpin]);
+	if (!defined $shown || $text ne $shown) {
+	    printf "%12.6fs  [%s]\n", $lt, $text;
+	    $shown = $text;
+	}
+    }
+}
+
+sub stats {
+    my @x = @_;
+    my ($n, $sum, $sq) = (scalar @x, 0, 0);
+    my ($min, $max) = ($x[0], $x[0]);
+
+    for (@x) {
+	$sum += $_;
+	$sq += $_ * $_;
+	$min = $_ if $_ < $min;
+	$max = $_ if $_ > $max;
+    }
+    my $mean = $sum / $n;
+    my $var = $sq / $n - $mean * $mean;
+    return ($n, $mean, $min, $max, $var > 0 ? sqrt($var) : 0);
+}
+
+sub us { sprintf '%8.1f', $_[0] * 1e6 }
+
+printf "%d latches over %.3fs\n", scalar @latch,
+    $latch[-1][0] - $latch[0][0];
+printf "skipped %d with %s\n", $bad{$_}, $_ for sort keys %bad;
+
+print "\nrefresh period per digit (us):\n";
+print "digit        n     mean      min      max   stddev   jitter\n";
+my @all;
+for my $d (sort { $a <=> $b } keys %period) {
+    my ($n, $mean, $min, $max, $sd) = stats(@{$period{$d}});
+    printf "%5d %8d %s %s %s %s %s\n", $d, $n, us($mean), us($min),
+	us($max), us($sd), us($max - $min);
+    push @all, @{$period{$d}};
+}
+if (@all) {
+    my ($n, $mean, $min, $max, $sd) = stats(@all);
+    printf "  all %8d %s %s %s %s %s  (%.1f Hz)\n", $n, us($mean),
+	us($min), us($max), us($sd), us($max - $min), 1 / $mean;
+}
+
+print "\non-time per digit (us):\n";
+print "digit        n     mean      min      max   stddev   duty\n";
+for my $d (sort { $a <=> $b } keys %on) {
+    my ($n, $mean, $min, $max, $sd) = stats(@{$on{$d}});
+    my $p = $period{$d} ? (stats(@{$period{$d}}))[1] : 0;
+    printf "%5d %8d %s %s %s %s %5.1f%%\n", $d, $n, us($mean), us($min),
+	us($max), us($sd), $p ? 100 * $mean / $p : 0;
+}
+
+printf "\non-time histograms, %gus buckets:\n", $bucket * 1e6;
+for my $d (sort { $a <=> $b } keys %on) {
+    my %hist;
+    $hist{int($_ / $bucket)}++ for @{$on{$d}};
+    my $n = @{$on{$d}};
+    print "digit $d\n";
+    for my $b (sort { $a <=> $b } keys %hist) {
+	printf "  %7.0f-%-7.0f %6d %s\n", $b * $bucket * 1e6,
+	    ($b + 1) * $bucket * 1e6, $hist{$b},
+	    '#' x int(50 * $hist{$b} / $n + 0.5);
+    }
+}